@@ -0,0 +1,84 @@
+/*
+Copyright (c) 2020 Naomasa Matsubayashi
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef IFM_ADDITIVE_H
+#define IFM_ADDITIVE_H
+#include <vector>
+#include <complex>
+#include <chrono>
+#include <limits>
+#include <tuple>
+#include <smfp/2op.hpp>
+#include <smfp/mixer.hpp>
+#include <ifm/fft.h>
+namespace ifm {
+  // 2opのFM音源をベッセル関数で展開した側帯波の和として周波数領域で合成する
+  // ハン窓のフレームをres/2サンプル毎に逆FFTしてoverlap-addする
+  class additive_synth_t {
+  public:
+    additive_synth_t( std::chrono::nanoseconds step_, size_t res = 1024u );
+    template< typename Channels, typename Sink >
+    void operator()( Channels &channels, smfp::mixer_t &mixer, size_t count, Sink &sink ) {
+      for( size_t i = 0u; i != count; ++i ) {
+        float env_sum = 0.f;
+        for( auto &channel: channels ) {
+          const auto [env,gain] = channel.advance( step );
+          if( env != -std::numeric_limits< float >::infinity() )
+            env_sum += gain;
+        }
+        env_sums[ filled++ ] = env_sum;
+        if( filled == hop ) {
+          for( const auto &channel: channels )
+            add( channel.get_partials() );
+          sink( synthesize( mixer ) );
+        }
+      }
+    }
+    template< typename Channels, typename Sink >
+    void finish( Channels &channels, smfp::mixer_t &mixer, Sink &sink ) {
+      if( filled == 0u ) return;
+      for( const auto &channel: channels )
+        add( channel.get_partials() );
+      sink( synthesize( mixer ) );
+    }
+    void add( const smfp::fm_2op_nofb_partials_t& );
+  private:
+    void add_sinusoid( float amplitude, float phase, float frequency );
+    float get_kernel( float distance ) const;
+    const std::vector< float > &synthesize( smfp::mixer_t& );
+    std::chrono::nanoseconds step;
+    size_t resolution;
+    size_t hop;
+    size_t filled;
+    float bins_per_hz;
+    ifft_context_t ifft;
+    std::vector< float > bessel;
+    std::vector< float > kernel;
+    std::vector< std::complex< float > > spectrum;
+    std::vector< float > frame;
+    std::vector< float > tail;
+    std::vector< float > env_sums;
+    std::vector< float > output;
+  };
+}
+
+#endif
+
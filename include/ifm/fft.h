@@ -31,6 +31,7 @@ SOFTWARE.
 #include <exception>
 #include <stdexcept>
 #ifdef ENABLE_FFTW3
+#include <mutex>
 #include <fftw3.h>
 #else
 #include <pffft.hpp>
@@ -44,10 +45,15 @@ namespace ifm {
       if( p ) fftwf_free( p );
     }
   };
+  // FFTWのプランの作成と破棄はスレッドセーフでないので、全てのコンテキストでこのmutexを取って行う
+  std::mutex &get_fftw_plan_mutex();
   struct free_fftw_plan {
     template< typename T >
     void operator()( T p ) {
-      if( p ) fftwf_destroy_plan( p );
+      if( p ) {
+        std::lock_guard< std::mutex > lock( get_fftw_plan_mutex() );
+        fftwf_destroy_plan( p );
+      }
     }
   };
 #endif
@@ -74,6 +80,25 @@ private:
   std::unique_ptr< std::remove_pointer_t< fftwf_plan >, free_fftw_plan > plan;
 #endif
 };
+class ifft_context_t {
+public:
+  ifft_context_t( size_t res );
+  // res/2+1要素のスペクトルから実信号を復元する(1/resの正規化はしない)
+  void inverse( const std::vector< std::complex< float > >&, std::vector< float >& );
+private:
+#ifdef ENABLE_FFTW3
+  std::unique_ptr< fftwf_complex, free_fftw_mem > input;
+  std::unique_ptr< float, free_fftw_mem > output;
+#else
+  pffft::Fft< float > fft;
+  pffft::AlignedVector< std::complex< float > > input;
+  pffft::AlignedVector< float > output;
+#endif
+  size_t resolution;
+#ifdef ENABLE_FFTW3
+  std::unique_ptr< std::remove_pointer_t< fftwf_plan >, free_fftw_plan > plan;
+#endif
+};
 }
 
 #endif
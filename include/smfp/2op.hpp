@@ -2,6 +2,7 @@
 #define SMFP_2OP_HPP
 
 #include <chrono>
+#include <vector>
 #include <stamp/setter.hpp>
 #include <smfp/channel_state.hpp>
 #include <smfp/active_note.hpp>
@@ -9,6 +10,20 @@
 #include <smfp/fmeg.hpp>
 
 namespace smfp {
+  enum class fm_2op_nofb_kernel_t {
+    full,
+    // モジュレータのエンベロープがサステインだけで、押鍵中はモジュレータのゲインが変わらない
+    constant_modulator,
+    carrier_only,
+    silent
+  };
+  std::string to_string( fm_2op_nofb_kernel_t v );
+  enum class fm_2op_nofb_cycle_state_t {
+    idle,
+    recording,
+    playing,
+    disabled
+  };
   struct fm_2op_nofb_config_t {
     fm_2op_nofb_config_t() {}
     fm_2op_nofb_config_t( const nlohmann::json &config );
@@ -18,6 +33,18 @@ namespace smfp {
     fmeg_config_t< 1u > lower;
     fmeg_config_t< 0u > upper;
   };
+  // 設定をどう作ったかに関わらず同じ結果になるように、ボイスが設定を受け取る度に求める
+  fm_2op_nofb_kernel_t get_kernel( const fm_2op_nofb_config_t & );
+  // 出力をsin( carrier + index * sin( modulator ) ) * gainとして表したもの
+  // 位相は周期単位、周波数はHz
+  struct fm_2op_nofb_partials_t {
+    float gain;
+    float carrier_phase;
+    float carrier_frequency;
+    float modulator_phase;
+    float modulator_frequency;
+    float index;
+  };
   fm_2op_nofb_config_t lerp(
     const fm_2op_nofb_config_t &,
     const fm_2op_nofb_config_t &,
@@ -26,6 +53,10 @@ namespace smfp {
   class fm_2op_nofb_t {
   public:
     using config_type = fm_2op_nofb_config_t;
+    static std::string get_type_name() {
+      return "2op";
+    }
+    static constexpr bool has_partials = true;
     fm_2op_nofb_t( const fm_2op_nofb_config_t &config );
     fm_2op_nofb_t( const nlohmann::json &config );
     nlohmann::json dump() const;
@@ -40,6 +71,12 @@ namespace smfp {
       for( auto iter = begin; iter != end; ++iter )
         *iter = std::get< 1 >( (*this)( step ) );
     }
+    std::tuple< float, float > advance( std::chrono::nanoseconds step );
+    std::tuple< float, float > advance( std::chrono::nanoseconds step, uint64_t count );
+    // 波形を計算せずに、描画した場合と同じ状態になるように1サンプル進める
+    std::tuple< float, float > trace( std::chrono::nanoseconds step );
+    std::tuple< float, float > skip( std::chrono::nanoseconds step, uint64_t count );
+    fm_2op_nofb_partials_t get_partials() const;
     void set_variable( channel_variable_id_t /*id*/, note_t /*at*/, const channel_state_t &/*cst*/ );
     void set_program( const channel_state_t&,  uint8_t );
     void set_volume( const channel_state_t &cst, float value );
@@ -48,8 +85,25 @@ namespace smfp {
     }
     bool is_end() const;
   private:
+    std::tuple< float, float > render( std::chrono::nanoseconds step );
+    // 周期の状態を変えずにオペレータの位相とエンベロープを1サンプル進める
+    std::tuple< float, float > advance_operators( std::chrono::nanoseconds step );
+    bool has_modulator() const;
+    void update_modulator_gain();
+    void begin_cycle( std::chrono::nanoseconds step );
+    void record_cycle( const std::tuple< float, float >& );
+    void end_cycle();
     fmeg_t< 1u > lower;
     fmeg_t< 0u > upper;
+    fm_2op_nofb_kernel_t kernel;
+    // サステイン中の周期的な出力を1周期分記録して繰り返す
+    fm_2op_nofb_cycle_state_t cycle_state;
+    std::vector< float > cycle;
+    size_t cycle_pos;
+    float cycle_envelope;
+    std::chrono::nanoseconds cycle_step;
+    fm_t< 1u > cycle_lower;
+    fm_t< 0u > cycle_upper;
   };
 }
 
@@ -3,6 +3,7 @@
 
 #include <cstdint>
 #include <array>
+#include <memory>
 #include <type_traits>
 #include <nlohmann/json.hpp>
 #include <stamp/setter.hpp>
@@ -86,68 +87,109 @@ namespace smfp {
     count = drum_chorus + 128
   };
   std::string to_string( channel_variable_id_t v );
-  struct channel_state_t {
+  // 頻繁に参照するコントローラを先頭に置いたcontrol内の並び
+  constexpr std::array< uint8_t, int( channel_variable_id_t::drum_pitch ) > control_index = [] {
+    constexpr std::array< channel_variable_id_t, 9u > hot{
+      channel_variable_id_t::volume,
+      channel_variable_id_t::expression,
+      channel_variable_id_t::foot,
+      channel_variable_id_t::breath,
+      channel_variable_id_t::soft,
+      channel_variable_id_t::hold1,
+      channel_variable_id_t::pitch_bend_sensitivity,
+      channel_variable_id_t::master_fine_tune,
+      channel_variable_id_t::master_coarse_tune
+    };
+    std::array< uint8_t, int( channel_variable_id_t::drum_pitch ) > index{};
+    std::array< bool, int( channel_variable_id_t::drum_pitch ) > is_hot{};
+    uint8_t next = 0u;
+    for( auto id: hot ) {
+      index[ int( id ) ] = next++;
+      is_hot[ int( id ) ] = true;
+    }
+    for( int i = 0; i != int( channel_variable_id_t::drum_pitch ); ++i )
+      if( !is_hot[ i ] ) index[ i ] = next++;
+    return index;
+  }();
+  constexpr int get_control_index( channel_variable_id_t id ) {
+    return control_index[ int( id ) ];
+  }
+  constexpr int drum_variable_count = int( channel_variable_id_t::count ) - int( channel_variable_id_t::drum_pitch );
+  using drum_state_t = std::array< uint16_t, drum_variable_count >;
+  // ドラムのパラメータは値が書き込まれた時に初めて確保し、コピー間で共有して書き込み時に複製する
+  struct alignas( 64 ) channel_state_t {
     channel_state_t( const global_state_t *gst );
     channel_state_t( const channel_state_t& ) = default;
     channel_state_t( channel_state_t&& ) = default;
     channel_state_t &operator=( const channel_state_t& ) = default;
     channel_state_t &operator=( channel_state_t&& ) = default;
+    bool operator==( const channel_state_t& ) const;
     nlohmann::json to_json() const;
-    auto &operator[]( channel_variable_id_t id ) {
-      return control[ int( id ) ];
+    // 値を書き換え、その値から求める量を計算し直す
+    void set( channel_variable_id_t id, uint16_t value ) {
+      if( int( id ) >= int( channel_variable_id_t::drum_pitch ) ) {
+        get_drum()[ int( id ) - int( channel_variable_id_t::drum_pitch ) ] = value;
+        return;
+      }
+      auto &v = control[ get_control_index( id ) ];
+      if( v == value ) return;
+      v = value;
+      update( id );
     }
-    const auto &operator[]( channel_variable_id_t id ) const {
-      return control[ int( id ) ];
+    const uint16_t &operator[]( channel_variable_id_t id ) const {
+      if( int( id ) >= int( channel_variable_id_t::drum_pitch ) )
+        return ( drum ? *drum : default_drum )[ int( id ) - int( channel_variable_id_t::drum_pitch ) ];
+      return control[ get_control_index( id ) ];
     }
 
 #define SMFP_CHANNEL_STATE_DIRECT( name ) \
     template< channel_variable_id_t vid > \
     auto get() const -> std::enable_if_t< vid == channel_variable_id_t:: name , uint16_t > { \
-      return control[ int( channel_variable_id_t :: name ) ]; \
+      return control[ get_control_index( channel_variable_id_t :: name ) ]; \
     }
 #define SMFP_CHANNEL_STATE_SHIFT( name, count ) \
     template< channel_variable_id_t vid > \
     auto get() const -> std::enable_if_t< vid == channel_variable_id_t:: name , uint8_t > { \
-      return uint8_t( control[ int( channel_variable_id_t :: name ) ] >> count ); \
+      return uint8_t( control[ get_control_index( channel_variable_id_t :: name ) ] >> count ); \
     }
 #define SMFP_CHANNEL_STATE_UFLOAT( name ) \
     template< channel_variable_id_t vid > \
     auto get() const -> std::enable_if_t< vid == channel_variable_id_t:: name , float > { \
-      return control[ int( channel_variable_id_t :: name ) ] / float( 0x3FFFu ); \
+      return control[ get_control_index( channel_variable_id_t :: name ) ] / float( 0x3FFFu ); \
     }
 #define SMFP_CHANNEL_STATE_UFLOAT_SHIFT( name ) \
     template< channel_variable_id_t vid > \
     auto get() const -> std::enable_if_t< vid == channel_variable_id_t:: name , float > { \
-      return control[ int( channel_variable_id_t :: name ) ] / float( 0x2000u ) - 1.f; \
+      return control[ get_control_index( channel_variable_id_t :: name ) ] / float( 0x2000u ) - 1.f; \
     }
 #define SMFP_CHANNEL_STATE_UFLOAT_SCALE( name, denom, scale ) \
     template< channel_variable_id_t vid > \
     auto get() const -> std::enable_if_t< vid == channel_variable_id_t:: name , float > { \
-      return control[ int( channel_variable_id_t :: name ) ] / float( denom ) * scale; \
+      return control[ get_control_index( channel_variable_id_t :: name ) ] / float( denom ) * scale; \
     }
 #define SMFP_CHANNEL_STATE_SFLOAT( name, denom ) \
     template< channel_variable_id_t vid > \
     auto get() const -> std::enable_if_t< vid == channel_variable_id_t:: name , float > { \
-      return ( control[ int( channel_variable_id_t :: name ) ] < denom ) ? \
-        ( control[ int( channel_variable_id_t :: name ) ] / float( denom ) ) : \
-        ( ( int16_t( control[ int( channel_variable_id_t :: name ) ] ) - ( denom * 2 ) ) / float( denom ) ); \
+      return ( control[ get_control_index( channel_variable_id_t :: name ) ] < denom ) ? \
+        ( control[ get_control_index( channel_variable_id_t :: name ) ] / float( denom ) ) : \
+        ( ( int16_t( control[ get_control_index( channel_variable_id_t :: name ) ] ) - ( denom * 2 ) ) / float( denom ) ); \
     }
 #define SMFP_CHANNEL_STATE_BOOL( name, threshold ) \
     template< channel_variable_id_t vid > \
     auto get() const -> std::enable_if_t< vid == channel_variable_id_t:: name , bool > { \
-      return control[ int( channel_variable_id_t :: name ) ] < threshold; \
+      return control[ get_control_index( channel_variable_id_t :: name ) ] < threshold; \
     }
 #define SMFP_CHANNEL_STATE_FCUFLOAT( name ) \
     template< channel_variable_id_t vid > \
     auto get() const -> std::enable_if_t< vid == channel_variable_id_t:: name ,float > { \
-      auto coarse = ( control[ int( channel_variable_id_t:: name ) ] >> 7 ); \
-      auto fine = ( control[ int( channel_variable_id_t:: name ) ] & 0x7F ) / 128.f; \
+      auto coarse = ( control[ get_control_index( channel_variable_id_t:: name ) ] >> 7 ); \
+      auto fine = ( control[ get_control_index( channel_variable_id_t:: name ) ] & 0x7F ) / 128.f; \
       return coarse + fine; \
     }
 #define SMFP_CHANNEL_STATE_LUFLOAT( name, min_, scale ) \
     template< channel_variable_id_t vid > \
     auto get() const -> std::enable_if_t< vid == channel_variable_id_t:: name , float > { \
-      return ( ( std::min( std::max( uint16_t( min_ ), control[ int( channel_variable_id_t :: name ) ] ), uint16_t( 0x3FFFu - ( min_ ) ) ) - ( min_ ) ) / float( 0x2000u - ( min_ ) ) - 1.f ) * scale; \
+      return ( ( std::min( std::max( uint16_t( min_ ), control[ get_control_index( channel_variable_id_t :: name ) ] ), uint16_t( 0x3FFFu - ( min_ ) ) ) - ( min_ ) ) / float( 0x2000u - ( min_ ) ) - 1.f ) * scale; \
     }
     SMFP_CHANNEL_STATE_DIRECT( bank )
     SMFP_CHANNEL_STATE_FCUFLOAT( modulation )
@@ -212,40 +254,70 @@ namespace smfp {
     template< channel_variable_id_t vid >
     auto get() const -> std::enable_if_t< vid == channel_variable_id_t::portamento_time, float > {
       return
-        ( control[ int( channel_variable_id_t:: portamento_switch ) ] < 0x2000u ) ?
+        ( control[ get_control_index( channel_variable_id_t:: portamento_switch ) ] < 0x2000u ) ?
         0.f :
-        ( control[ int( channel_variable_id_t::portamento_time ) ] / float( 0x3fffu ) );
+        ( control[ get_control_index( channel_variable_id_t::portamento_time ) ] / float( 0x3fffu ) );
     }
     template< channel_variable_id_t vid >
     auto get() const -> std::enable_if_t< vid == channel_variable_id_t::volume, float > {
-      const std::array< float, 6u > values{
-        control[ int( channel_variable_id_t::volume ) ] / float( 0x3FFF ),
-        control[ int( channel_variable_id_t::expression ) ] / float( 0x3FFF ),
-        control[ int( channel_variable_id_t::foot ) ] / float( 0x3FFF ),
-        control[ int( channel_variable_id_t::breath ) ] / float( 0x3FFF ),
-        pressure / float( 0x7F ),
-        ( ( control[ int( channel_variable_id_t::soft ) ] >> 7 ) + 0x100u ) / float( 0x17Fu )
-      };
-      if( std::find( values.begin(), values.end(), 0.f ) != values.end() ) return -std::numeric_limits< float >::infinity();
-      return std::accumulate( values.begin(), values.end(), 0.f, []( auto sum, auto v ) {
-        return sum + 40 * std::log10( v );
-      } );
+      return volume;
     }
     template< channel_variable_id_t vid >
     auto get() const -> std::enable_if_t< vid == channel_variable_id_t::master_fine_tune, float > {
-      auto fine = ( uint32_t( control[ int( channel_variable_id_t::master_fine_tune ) ] ) ) / float( 0x2000u ) - 1.f;
-      auto coarse = float( control[ int( channel_variable_id_t::master_coarse_tune ) ] >> 7 ) - 64.f;
+      auto fine = ( uint32_t( control[ get_control_index( channel_variable_id_t::master_fine_tune ) ] ) ) / float( 0x2000u ) - 1.f;
+      auto coarse = float( control[ get_control_index( channel_variable_id_t::master_coarse_tune ) ] >> 7 ) - 64.f;
       return coarse + fine;
     }
-    float get_pitch_bend() const;
+    // ピッチベンドの半音単位の値
+    float get_pitch_bend() const {
+      return pitch_bend_semitones;
+    }
+    // ピッチベンドのメッセージの値
+    pitch_t get_pitch_bend_value() const {
+      return pitch_bend;
+    }
+    uint8_t get_pressure() const {
+      return pressure;
+    }
+    // ピッチベンドとマスターチューンを合わせた周波数の倍率
+    float get_pitch_ratio() const {
+      return pitch_ratio;
+    }
+    float get_attack_time_scale() const {
+      return attack_time_scale;
+    }
+    float get_decay_time_scale() const {
+      return decay_time_scale;
+    }
+    float get_release_time_scale() const {
+      return release_time_scale;
+    }
     LIBSTAMP_SETTER( program )
-    LIBSTAMP_SETTER( pitch_bend )
-    LIBSTAMP_SETTER( pressure )
+    channel_state_t &set_pitch_bend( pitch_t value );
+    channel_state_t &set_pressure( uint8_t value );
     const global_state_t *global_state;
     program_id_t program;
+  private:
+    // 書き換えはset_pitch_bendとset_pressureを通して行う
     pitch_t pitch_bend;
     uint8_t pressure;
-    std::array< uint16_t, int( channel_variable_id_t::count ) > control;
+    // controlなどから求めた値
+    // 元になる値が変わった時だけ計算し直す
+    float volume;
+    float pitch_bend_semitones;
+    float pitch_ratio;
+    float attack_time_scale;
+    float decay_time_scale;
+    float release_time_scale;
+    // 書き換えはsetを通して行い、求めた値が古くならないようにする
+    std::array< uint16_t, int( channel_variable_id_t::drum_pitch ) > control;
+    std::shared_ptr< drum_state_t > drum;
+    void update( channel_variable_id_t id );
+    void update_volume();
+    void update_pitch_bend();
+    void update_envelope();
+    drum_state_t &get_drum();
+    static const drum_state_t default_drum;
   };
 }
 
@@ -0,0 +1,77 @@
+#ifndef SMFP_COALESCE_HPP
+#define SMFP_COALESCE_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+namespace smfp {
+  // 1ブロックの間に同じチャンネルの同じコントローラに届いた値は最後の1つだけをパーサに渡す
+  // 音量やピッチベンドは最後の値しか聞こえないので、ボイス毎の再計算をブロック毎に1回にできる
+  // ノートやRPN/NRPN、ホールドのように順序に意味があるメッセージが来たら、それまでに溜めた値を先に渡す
+  template< typename Parser >
+  class controller_coalescer_t {
+  public:
+    controller_coalescer_t( Parser &parser_ ) : parser( &parser_ ) {
+      index.fill( none );
+    }
+    template< typename Iterator >
+    void operator()( uint8_t status, const Iterator &begin, const Iterator &end ) {
+      const auto target = get_target( status, begin, end );
+      if( target == none ) {
+        flush();
+        ( *parser )( status, begin, end );
+        return;
+      }
+      auto &i = index[ ( status & 0x0F ) * targets + target ];
+      if( i == none ) {
+        i = pending.size();
+        pending.push_back( entry_t{ status, uint8_t( std::distance( begin, end ) ), { 0u, 0u } } );
+      }
+      std::copy( begin, end, pending[ i ].data.begin() );
+    }
+    // 溜めた値を届いた順にパーサに渡す
+    // ブロックを描画する前に呼ぶ
+    void flush() {
+      for( const auto &e: pending ) {
+        index[ ( e.status & 0x0F ) * targets + get_target( e.status, e.data.begin(), std::next( e.data.begin(), e.length ) ) ] = none;
+        ( *parser )( e.status, e.data.data(), std::next( e.data.data(), e.length ) );
+      }
+      pending.clear();
+    }
+  private:
+    struct entry_t {
+      uint8_t status;
+      uint8_t length;
+      std::array< uint8_t, 2u > data;
+    };
+    static constexpr uint16_t none = 0xFFFF;
+    // 0から127はコントロールチェンジ、128はピッチベンド、129はチャンネルプレッシャー
+    static constexpr size_t targets = 130u;
+    // 他のメッセージとの順序に関係なく最後の値だけで状態が決まるコントローラ
+    static constexpr std::array< bool, 128u > coalescable = [] {
+      std::array< bool, 128u > v{};
+      for( uint8_t target: {
+        1, 2, 4, 5, 7, 8, 10, 11, 12, 13, 16, 17, 18, 19,
+        33, 34, 36, 37, 39, 40, 42, 43, 44, 45, 48, 49, 50, 51,
+        67, 70, 71, 72, 73, 74, 75, 76, 77, 78, 80, 81, 82, 83,
+        91, 92, 93, 94, 95
+      } ) v[ target ] = true;
+      return v;
+    }();
+    template< typename Iterator >
+    static uint16_t get_target( uint8_t status, const Iterator &begin, const Iterator &end ) {
+      if( ( status & 0xF0 ) == 0xB0 && std::distance( begin, end ) == 2 && *begin < 128u && coalescable[ *begin ] ) return *begin;
+      if( ( status & 0xF0 ) == 0xE0 && std::distance( begin, end ) == 2 ) return 128u;
+      if( ( status & 0xF0 ) == 0xD0 && std::distance( begin, end ) == 1 ) return 129u;
+      return none;
+    }
+    Parser *parser;
+    std::array< uint16_t, 16u * targets > index;
+    std::vector< entry_t > pending;
+  };
+}
+
+#endif
@@ -1,6 +1,9 @@
 #ifndef SMFP_DUMMY_HANDLER_HPP
 #define SMFP_DUMMY_HANDLER_HPP
 
+#include <chrono>
+#include <tuple>
+#include <limits>
 #include <iostream>
 #include <smfp/types.hpp>
 #include <smfp/channel_state.hpp>
@@ -9,6 +12,11 @@
 namespace smfp {
   class dummy_handler {
   public:
+    dummy_handler() : quiet( false ) {}
+    // trueの間は受け取ったイベントを表示しない
+    void set_quiet( bool value ) {
+      quiet = value;
+    }
     void note_on( const channel_state_t &cst, const active_note_t &nst );
     void clear( const channel_state_t & );
     void note_off( const channel_state_t & );
@@ -16,8 +24,10 @@ namespace smfp {
     void set_variable( channel_variable_id_t id, note_t at, const channel_state_t &cst );
     void set_volume( const channel_state_t &, float value );
     void set_frequency( const channel_state_t &, float value );
+    std::tuple< float, float > skip( std::chrono::nanoseconds, uint64_t );
     template< typename Iterator >
     void system_exclusive( const channel_state_t &, Iterator begin, Iterator end ) {
+      if( quiet ) return;
       std::cout << "sysex " << std::hex;
       for( auto iter = begin; iter != end; ++iter )
         std::cout << uint32_t( *iter ) << " ";
@@ -25,6 +35,7 @@ namespace smfp {
     }
   private:
     active_note_t note_info;
+    bool quiet;
   };
 }
 #endif
@@ -48,9 +48,11 @@ namespace smfp {
     const envelope_generator_config_t&,
     float
   );
+  bool is_silent( const envelope_generator_config_t& );
+  bool is_sustain_only( const envelope_generator_config_t& );
   class envelope_generator_t {
-    constexpr static float lowest = -4.f;
   public:
+    constexpr static float lowest = -4.f;
     using config_type = envelope_generator_config_t;
     envelope_generator_t( const nlohmann::json &config );
     envelope_generator_t( const envelope_generator_config_t &config );
@@ -61,7 +63,11 @@ namespace smfp {
     void note_off( const channel_state_t & );
     void operator()( std::chrono::nanoseconds step, float *begin, float *end );
     float operator()( std::chrono::nanoseconds step );
+    float skip( std::chrono::nanoseconds step, uint64_t count );
     bool is_end() const;
+    bool is_sustain() const {
+      return state == &envelope_generator_t::calc_sustain;
+    }
     void set_volume( const channel_state_t &, float vol );
   private:
     void init_delay();
@@ -73,6 +79,7 @@ namespace smfp {
     void init_sustain();
     void init_release();
     void init_end();
+    uint64_t get_remaining_steps( std::chrono::nanoseconds step ) const;
     float calc_delay( std::chrono::nanoseconds step );
     float calc_attack1( std::chrono::nanoseconds step );
     float calc_attack2( std::chrono::nanoseconds step );
@@ -15,6 +15,11 @@ namespace smfp {
   SMFP_EXCEPTION( runtime_error, invalid_midi_operation )
   SMFP_EXCEPTION( runtime_error, slot_lost )
   SMFP_EXCEPTION( runtime_error, invalid_instrument_config )
+  SMFP_EXCEPTION( runtime_error, unable_to_write_stem )
+  SMFP_EXCEPTION( runtime_error, unable_to_read_stem )
+  SMFP_EXCEPTION( runtime_error, unable_to_open_midi_input )
+  SMFP_EXCEPTION( runtime_error, unable_to_open_output )
+  SMFP_EXCEPTION( runtime_error, unable_to_write_output )
 }
 #endif
 
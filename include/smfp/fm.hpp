@@ -98,12 +98,54 @@ namespace smfp {
         return sum + *( input++ ) * v;
       });
       auto value = std::sin( ( diff + tangent * at + shift ) * float( M_PI ) * 2.f );
+      advance( step );
+      return value;
+    }
+    void advance( std::chrono::nanoseconds step ) {
       at += std::chrono::duration_cast< std::chrono::duration< float > >( step ).count();
       if( at >= 1.f ) {
         shift = tangent * at;
         at = 0;
       }
-      return value;
+    }
+    // advanceをcount回呼ぶ
+    // skipと違って描画と同じ計算で位相を進めるので、続けて描画した場合と位相が一致する
+    void advance( std::chrono::nanoseconds step, uint64_t count ) {
+      for( uint64_t i = 0u; i != count; ++i ) advance( step );
+    }
+    // advanceをcount回呼んだのと同じ状態にする
+    void skip( std::chrono::nanoseconds step, uint64_t count ) {
+      const float dt = std::chrono::duration_cast< std::chrono::duration< float > >( step ).count();
+      const auto until_wrap = [&]( float from ) {
+        return uint64_t( std::max( std::ceil( ( 1.f - from ) / dt ), 1.f ) );
+      };
+      const auto first = until_wrap( at );
+      if( count < first ) {
+        at += float( count ) * dt;
+        return;
+      }
+      count -= first;
+      shift = tangent * ( at + float( first ) * dt );
+      at = 0;
+      // 2回目以降の巻き戻しは常に0から始まるので周期が一定になる
+      const auto period = until_wrap( 0.f );
+      if( count >= period ) {
+        shift = tangent * ( float( period ) * dt );
+        count %= period;
+      }
+      at = float( count ) * dt;
+    }
+    float get_phase() const {
+      return tangent * at + shift;
+    }
+    float get_tangent() const {
+      return tangent;
+    }
+    float get_time() const {
+      return at;
+    }
+    const fm_config_t< operator_count > &get_config() const {
+      return config;
     }
   private:
     fm_config_t< operator_count > config;
@@ -45,7 +45,9 @@ namespace smfp {
     using config_type = fmeg_config_t< i >;
     fmeg_t( const fmeg_config_t< i > &config ) :
       eg( config.eg ),
-      fm( config.fm ) {}
+      fm( config.fm ),
+      last_envelope( -std::numeric_limits< float >::infinity() ),
+      gain( 0.f ) {}
     fmeg_t( const nlohmann::json &config ) :
       fmeg_t( fmeg_config_t< i >( config ) ) {}
     nlohmann::json dump() const {
@@ -74,8 +76,43 @@ namespace smfp {
     template< typename Iterator >
     std::tuple< float, float > operator()( std::chrono::nanoseconds step, Iterator input ) {
       auto envelope = eg( step );
+      set_envelope( envelope );
       if( envelope == -std::numeric_limits< float >::infinity() ) return std::make_tuple( envelope, 0.f );
-      return std::make_tuple( envelope, std::pow( 10.f, envelope / 40.f ) * fm( step, input ) );
+      return std::make_tuple( envelope, gain * fm( step, input ) );
+    }
+    // 波形を計算せずに状態だけを1サンプル進める
+    std::tuple< float, float > advance( std::chrono::nanoseconds step ) {
+      auto envelope = eg( step );
+      set_envelope( envelope );
+      if( envelope == -std::numeric_limits< float >::infinity() ) return std::make_tuple( envelope, 0.f );
+      fm.advance( step );
+      return std::make_tuple( envelope, gain );
+    }
+    // 波形を計算せずに状態をcountサンプル進める
+    // エンベロープはskipと同様に解析的に進め、位相は描画と同じ計算で進める
+    std::tuple< float, float > advance( std::chrono::nanoseconds step, uint64_t count ) {
+      if( count == 0u ) return std::make_tuple( last_envelope, gain );
+      auto envelope = eg.skip( step, count );
+      set_envelope( envelope );
+      if( envelope == -std::numeric_limits< float >::infinity() ) return std::make_tuple( envelope, 0.f );
+      fm.advance( step, count );
+      return std::make_tuple( envelope, gain );
+    }
+    // 波形を計算せずに状態だけをcountサンプル進める
+    std::tuple< float, float > skip( std::chrono::nanoseconds step, uint64_t count ) {
+      if( count == 0u ) return std::make_tuple( last_envelope, gain );
+      auto envelope = eg.skip( step, count );
+      set_envelope( envelope );
+      if( envelope == -std::numeric_limits< float >::infinity() ) return std::make_tuple( envelope, 0.f );
+      fm.skip( step, count );
+      return std::make_tuple( envelope, gain );
+    }
+    void set_envelope( float envelope ) {
+      // サステイン中はエンベロープが変化しないのでpowを省略する
+      if( envelope != last_envelope ) {
+        last_envelope = envelope;
+        gain = std::pow( 10.f, envelope / 40.f );
+      }
     }
     void set_volume( const channel_state_t &cst, float vol ) {
       eg.set_volume( cst, vol );
@@ -85,6 +122,8 @@ namespace smfp {
     }
     envelope_generator_t eg;
     fm_t< i > fm;
+    float last_envelope;
+    float gain;
   };
 }
 
@@ -0,0 +1,20 @@
+#ifndef SMFP_INSTRUMENT_HPP
+#define SMFP_INSTRUMENT_HPP
+
+#include <smfp/2op.hpp>
+#include <smfp/nop.hpp>
+#include <smfp/sine.hpp>
+#include <smfp/variable.hpp>
+#include <smfp/variant_instrument.hpp>
+
+namespace smfp {
+  // バンクの楽器ごとにtypeで選べる音源
+  using instrument_t = variant_instrument_t<
+    variable_t< fm_2op_nofb_t >,
+    variable_t< fm_nop_t< 4u > >,
+    variable_t< sine_t >
+  >;
+}
+
+#endif
+
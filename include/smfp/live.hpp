@@ -0,0 +1,143 @@
+#ifndef SMFP_LIVE_HPP
+#define SMFP_LIVE_HPP
+
+#include <cstdint>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <smfp/midi_parser.hpp>
+
+namespace smfp {
+  // 生のMIDIバイト列を1メッセージずつに区切る
+  // ランニングステータスを扱い、リアルタイムメッセージは読み捨てる
+  // システムエクスクルーシブはmidi_parser_tが期待するSMFと同じ長さ付きの形にして渡す
+  // 未定義のシステムコモンメッセージは後に続くデータバイトごと読み捨てる
+  class midi_byte_decoder_t {
+  public:
+    midi_byte_decoder_t() : status( 0u ), expected( 0u ), in_sysex( false ) {}
+    template< typename F >
+    void operator()( uint8_t byte, F &&func ) {
+      if( byte >= 0xF8 ) return;
+      if( byte & 0x80 ) {
+        if( byte == 0xF7 ) {
+          if( in_sysex ) {
+            message.push_back( 0xF7 );
+            // 長さを可変長数値にして先頭に付ける
+            std::array< uint8_t, 5u > head;
+            auto head_begin = head.end();
+            uint32_t length = message.size();
+            *--head_begin = uint8_t( length & 0x7F );
+            while( length >>= 7 ) *--head_begin = uint8_t( 0x80 | ( length & 0x7F ) );
+            message.insert( message.begin(), head_begin, head.end() );
+            func( uint8_t( 0xF0 ), message.begin(), message.end() );
+          }
+          in_sysex = false;
+          status = 0u;
+          message.clear();
+          return;
+        }
+        in_sysex = byte == 0xF0;
+        status = ( in_sysex || byte == 0xF4 || byte == 0xF5 ) ? 0u : byte;
+        message.clear();
+        if( byte == 0xF1 || byte == 0xF3 ) expected = 1u;
+        else if( byte == 0xF6 ) expected = 0u;
+        else if( ( byte & 0xF0 ) == 0xC0 || ( byte & 0xF0 ) == 0xD0 ) expected = 1u;
+        else expected = 2u;
+        if( status && expected == 0u ) emit( func );
+        return;
+      }
+      if( in_sysex ) {
+        message.push_back( byte );
+        return;
+      }
+      if( !status ) return;
+      message.push_back( byte );
+      if( message.size() == expected ) emit( func );
+    }
+  private:
+    template< typename F >
+    void emit( F &func ) {
+      func( status, message.begin(), message.end() );
+      message.clear();
+      // ランニングステータスはチャンネルメッセージにだけ適用する
+      if( status >= 0xF0 ) status = 0u;
+    }
+    uint8_t status;
+    size_t expected;
+    bool in_sysex;
+    std::vector< uint8_t > message;
+  };
+  struct live_event_t {
+    std::chrono::steady_clock::time_point at;
+    uint8_t status;
+    std::vector< uint8_t > data;
+  };
+  // FIFOかUNIXソケットからMIDIバイト列を読むスレッドを持ち、届いた時刻を付けたイベントを溜める
+  class live_input_t {
+  public:
+    live_input_t( const std::string &path );
+    ~live_input_t();
+    live_input_t( const live_input_t& ) = delete;
+    live_input_t &operator=( const live_input_t& ) = delete;
+    // untilまでに届いたイベントを届いた順にeventsに移す
+    void take( std::chrono::steady_clock::time_point until, std::vector< live_event_t > &events );
+    // 入力が閉じられ、それまでに届いたイベントが全て溜まっている
+    bool closed() const {
+      return eof;
+    }
+  private:
+    void run();
+    int fd;
+    std::atomic< bool > eof;
+    std::atomic< bool > stopping;
+    std::mutex guard;
+    std::deque< live_event_t > queue;
+    std::thread reader;
+  };
+  // 入力を実時間で再生する
+  // ブロックの終わりの時刻まで待ってからブロックを描画し、その間に届いたイベントは届いた時刻に対応するサンプルで適用する
+  // 描画したブロックはすぐに書き込みスレッドに渡す
+  template< typename Handler, typename Mixer, typename Sink >
+  void play_live(
+    live_input_t &input,
+    midi_parser_t< Handler > &parser,
+    Handler &handlers,
+    Mixer &mixer,
+    Sink &sink,
+    std::chrono::nanoseconds step,
+    size_t block_size
+  ) {
+    const auto start = std::chrono::steady_clock::now();
+    std::vector< float > buf( block_size );
+    std::vector< live_event_t > events;
+    for( uint64_t block = 0u; ; ++block ) {
+      const auto block_end = start + step * ( ( block + 1u ) * block_size );
+      std::this_thread::sleep_until( block_end );
+      const bool closed = input.closed();
+      events.clear();
+      // 入力が閉じていれば最後のブロックなので、block_endより後に届いたイベントも残さず適用する
+      input.take( closed ? std::chrono::steady_clock::time_point::max() : std::chrono::steady_clock::time_point( block_end ), events );
+      size_t done = 0u;
+      for( const auto &e: events ) {
+        const int64_t sample = ( e.at - start ) / step - int64_t( block * block_size );
+        const auto offset = size_t( std::min( std::max( sample, int64_t( done ) ), int64_t( block_size ) ) );
+        mixer( handlers, std::next( buf.begin(), done ), std::next( buf.begin(), offset ) );
+        done = offset;
+        parser( e.status, e.data.begin(), e.data.end() );
+      }
+      mixer( handlers, std::next( buf.begin(), done ), buf.end() );
+      sink( buf );
+      sink.flush();
+      if( closed ) break;
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef SMFP_LOAD_PROFILE_HPP
+#define SMFP_LOAD_PROFILE_HPP
+
+#include <array>
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <vector>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+#include <smfp/types.hpp>
+#include <smfp/channel_state.hpp>
+#include <smfp/active_note.hpp>
+
+namespace smfp {
+  class load_profile_t;
+  // 音を出さずに発音区間だけを記録するハンドラ
+  // note_offの後はリリースの長さだけ発音が続くものとして扱う
+  class load_voice_t {
+  public:
+    load_voice_t( load_profile_t *profile_ ) : profile( profile_ ), begin( 0u ), end( 0u ) {}
+    void note_on( const channel_state_t &cst, const active_note_t &nst );
+    void note_off( const channel_state_t &cst );
+    void clear( const channel_state_t &cst );
+    void set_program( const channel_state_t&, uint8_t ) {}
+    void set_variable( channel_variable_id_t, note_t, const channel_state_t& ) {}
+    void set_volume( const channel_state_t&, float ) {}
+    void set_frequency( const channel_state_t&, float ) {}
+    template< typename Iterator >
+    void system_exclusive( const channel_state_t&, Iterator, Iterator ) {}
+    bool is_active( uint64_t at ) const {
+      return begin <= at && at < end;
+    }
+    bool is_held() const {
+      return end == std::numeric_limits< uint64_t >::max();
+    }
+    // [from,to)のうち発音していた時間
+    uint64_t get_overlap( uint64_t from, uint64_t to ) const {
+      const auto b = std::max( begin, from );
+      const auto e = std::min( end, to );
+      return b < e ? e - b : 0u;
+    }
+  private:
+    friend class load_profile_t;
+    load_profile_t *profile;
+    uint64_t begin;
+    uint64_t end;
+  };
+  // SMFを実時間を待たずに再生して、描画の負荷を見積もる
+  // 時刻は全て先頭からのナノ秒
+  class load_profile_t {
+  public:
+    struct interval_t {
+      interval_t() : peak( 0u ), voice_time( 0u ) {
+        events.fill( 0u );
+      }
+      uint32_t peak;
+      // 区間内の発音時間の合計
+      uint64_t voice_time;
+      std::array< uint32_t, 16u > events;
+    };
+    load_profile_t(
+      size_t polyphony,
+      std::chrono::nanoseconds release_,
+      std::chrono::nanoseconds interval_
+    );
+    load_profile_t( const load_profile_t& ) = delete;
+    load_profile_t &operator=( const load_profile_t& ) = delete;
+    // midi_parser_tに渡すハンドラ
+    std::vector< load_voice_t > &get_voices() {
+      return voices;
+    }
+    // 時刻atまでの発音時間を集計する
+    void advance( uint64_t at );
+    // チャンネルメッセージを数えてからparserに渡す
+    template< typename Parser >
+    struct counter_t {
+      template< typename Iterator >
+      void operator()( uint8_t status, const Iterator &begin, const Iterator &end ) {
+        if( status < 0xF0 ) ++profile->intervals.back().events[ status & 0x0F ];
+        ( *parser )( status, begin, end );
+      }
+      load_profile_t *profile;
+      Parser *parser;
+    };
+    template< typename Parser >
+    counter_t< Parser > get_counter( Parser &parser ) {
+      return counter_t< Parser >{ this, &parser };
+    }
+    // voice_costとidle_costは発音中と無音のボイス1つが1サンプルを描画するのにかかる時間(ns)
+    nlohmann::json to_json( std::chrono::nanoseconds step, double voice_cost, double idle_cost ) const;
+  private:
+    friend class load_voice_t;
+    void on_note_on( load_voice_t &voice );
+    uint32_t get_active_voices() const;
+    std::vector< load_voice_t > voices;
+    std::vector< interval_t > intervals;
+    uint64_t release;
+    uint64_t interval;
+    uint64_t now;
+    uint64_t steals;
+    uint64_t release_cuts;
+  };
+}
+
+#endif
@@ -2,13 +2,13 @@
 #define SMFP_MIDI_PARSER_HPP
 #include <smfp/channel_state.hpp>
 #include <smfp/active_note.hpp>
+#include <smfp/voice_allocator.hpp>
 #include <smfp/exceptions.hpp>
 #include <smfp/header.hpp>
 #include <smfp/track.hpp>
 #include <smfp/get_volume.hpp>
 #include <smfp/get_frequency.hpp>
 #include <cmath>
-#include <stack>
 #include <array>
 #include <numeric>
 #include <algorithm>
@@ -18,40 +18,23 @@
 #include <bit>
 #include <thread>
 #include <type_traits>
-#include <boost/multi_index_container.hpp>
-#include <boost/multi_index/sequenced_index.hpp>
-#include <boost/multi_index/ordered_index.hpp>
-#include <boost/multi_index/member.hpp>
 
 namespace smfp {
-  namespace mi = boost::multi_index;
-  struct by_note {};
-  struct by_order {};
-  struct by_slot {};
   template< typename Handler >
   class midi_parser_t {
-    using slot_map_t = mi::multi_index_container<
-      active_note_t,
-      mi::indexed_by<
-        mi::ordered_unique<
-          mi::tag< by_note >,
-          mi::member< active_note_t, uint16_t, &active_note_t::channel_note >
-        >,
-        mi::ordered_unique<
-          mi::tag< by_order >,
-          mi::member< active_note_t, note_order_t, &active_note_t::order >
-        >,
-        mi::ordered_unique<
-          mi::tag< by_slot >,
-          mi::member< active_note_t, slot_t, &active_note_t::slot >
-        >
-      >
-    >;
   public:
-    midi_parser_t( Handler &handler_ ) : handler( handler_ ), note_count( 0 ) {
-      for( uint32_t i = 0; i != handler.size(); ++i )
-        available_slots.push( i );
-      channel_state.resize( handler.size(), channel_state_t( &global_state ) );
+    midi_parser_t( Handler &handler_ ) : handler( handler_ ), voices( handler.size() ), note_count( 0 ) {
+      channel_state.resize( 16u, channel_state_t( &global_state ) );
+    }
+    // 別のハンドラに対して、otherと同じ状態から再開するパーサを作る
+    midi_parser_t( Handler &handler_, const midi_parser_t &other ) :
+      handler( handler_ ),
+      voices( other.voices ),
+      channel_state( other.channel_state ),
+      note_count( other.note_count ),
+      global_state( other.global_state ) {
+      for( auto &cst: channel_state )
+        cst.global_state = &global_state;
     }
     template< typename Iterator >
     void operator()( uint8_t status, const Iterator &begin, const Iterator &end ) {
@@ -122,29 +105,20 @@ namespace smfp {
     }
     slot_t get_slot( channel_t channel, note_t note ) {
       const auto cn = ( uint16_t( channel ) << 8 )| note;
-      const std::array< slot_map_t*, 3u > slot_maps{ &note_off_map, &delayed_note_off_map, &note_on_map };
-      for( auto slot_map: slot_maps ) {
-        if( !slot_map->empty() ) {
-          auto same_note = slot_map->get< by_note >().find( cn );
-          if( same_note != slot_map->get< by_note >().end() ) {
-            clear( *same_note );
-            const auto slot = same_note->slot;
-            slot_map->get< by_note >().erase( same_note );
-            return slot;
-          }
-        }
-      }
-      if( !available_slots.empty() ) {
-        auto slot = available_slots.top();
-        available_slots.pop();
-        return slot;
-      }
-      for( auto slot_map: slot_maps ) {
-        if( !slot_map->empty() ) {
-          auto oldest = slot_map->get< by_order >().begin();
-          clear( *oldest );
-          slot_map->get< by_order >().erase( oldest );
-          return oldest->slot;
+      const auto same_note = voices.find( cn );
+      if( same_note != voice_allocator_t::none ) {
+        clear( voices.get( same_note ) );
+        voices.erase( same_note );
+        return same_note;
+      }
+      const auto available = voices.allocate();
+      if( available != voice_allocator_t::none ) return available;
+      for( auto state: { voice_state_t::note_off, voice_state_t::delayed_note_off, voice_state_t::note_on } ) {
+        const auto oldest = voices.oldest( state );
+        if( oldest != voice_allocator_t::none ) {
+          clear( voices.get( oldest ) );
+          voices.erase( oldest );
+          return oldest;
         }
       }
       throw slot_lost();
@@ -158,74 +132,59 @@ namespace smfp {
         .set_order( ++note_count )
         .set_velocity( velocity )
         .set_polyphonic_key_pressure( 127u );
-      auto [slot_iter,is_new] = note_on_map.insert( note_info );
-      if( !is_new ) throw invalid_midi_operation();
+      if( voices.find( cn ) != voice_allocator_t::none ) throw invalid_midi_operation();
+      voices.insert( note_info, voice_state_t::note_on );
       handler[ slot ].note_on( cst, note_info );
     }
     void note_off( channel_t channel, note_t note ) {
       auto &cst = channel_state[ channel ];
       const auto cn = ( uint16_t( channel ) << 8 )| note;
-      if( !note_on_map.empty() ) {
-        auto same_note = note_on_map.get< by_note >().find( cn );
-        if( same_note != note_on_map.get< by_note >().end() ) {
-          auto note_info = *same_note;
-          if( cst[ channel_variable_id_t::hold1 ] <= 0x3000u )
-            note_off_map.insert( note_info );
-          else
-            delayed_note_off_map.insert( note_info );
-          note_on_map.get< by_note >().erase( same_note );
-          if( cst[ channel_variable_id_t::hold1 ] <= 0x3000u )
-            handler[ same_note->slot ].note_off( cst );
-        }
+      const auto slot = voices.find( cn );
+      if( slot == voice_allocator_t::none || voices.get_state( slot ) != voice_state_t::note_on ) return;
+      if( cst[ channel_variable_id_t::hold1 ] <= 0x3000u ) {
+        voices.move( slot, voice_state_t::note_off );
+        handler[ slot ].note_off( cst );
       }
+      else
+        voices.move( slot, voice_state_t::delayed_note_off );
     }
     void set_hold1_msb( channel_t channel, uint8_t value ) {
       auto &cst = channel_state[ channel ];
       auto old = cst[ channel_variable_id_t::hold1 ];
       uint16_t shifted = uint16_t( value ) << 7;
       if( old == shifted ) return;
-      cst[ channel_variable_id_t::hold1 ] = shifted;
+      cst.set( channel_variable_id_t::hold1, shifted );
       if( !( shifted <= 0x3000u && old > 0x3000u ) ) return;
-      auto begin = delayed_note_off_map.get< by_note >().lower_bound( uint16_t( channel ) << 8 );
-      auto end = delayed_note_off_map.get< by_note >().lower_bound( uint16_t( channel + 1 ) << 8 );
-      std::vector< slot_t > removed;
-      for( auto iter = begin; iter != end; ++iter ) {
-        note_off_map.insert( *iter );
-        removed.push_back( iter->slot );
-      }
-      for( auto slot : removed )
-        delayed_note_off_map.get< by_slot >().erase( slot );
-      for( auto slot : removed )
-        handler[ slot ].note_off( cst );
+      std::array< slot_t, 256u > removed;
+      size_t removed_count = 0u;
+      voices.for_each( voice_state_t::delayed_note_off, [&]( const auto &note_info ) {
+        if( ( note_info.channel_note >> 8 ) == channel )
+          removed[ removed_count++ ] = note_info.slot;
+      } );
+      for( size_t i = 0u; i != removed_count; ++i )
+        voices.move( removed[ i ], voice_state_t::note_off );
+      for( size_t i = 0u; i != removed_count; ++i )
+        handler[ removed[ i ] ].note_off( cst );
     }
     template< typename F >
     void run_on_existing_note( channel_t channel, note_t note, F &&func ) {
-      const std::array< slot_map_t*, 3u > slot_maps{ &note_on_map, &delayed_note_off_map, &note_off_map };
-      for( auto slot_map: slot_maps ){
-        auto found = slot_map->get< by_note >().find( ( uint16_t( channel ) << 8 ) | note );
-        if( found != slot_map->get< by_note >().end() ) {
-          func( *found );
-          break;
-        }
-      }
+      const auto slot = voices.find( ( uint16_t( channel ) << 8 ) | note );
+      if( slot != voice_allocator_t::none ) func( voices.get( slot ) );
     }
     template< typename F >
     void for_each_notes_in_channel( channel_t channel, F &&func ) {
-      const std::array< slot_map_t*, 3u > slot_maps{ &note_on_map, &delayed_note_off_map, &note_off_map };
-      for( auto slot_map: slot_maps ){
-        auto begin = slot_map->get< by_note >().lower_bound( uint16_t( channel ) << 8 );
-        auto end = slot_map->get< by_note >().lower_bound( uint16_t( channel + 1 ) << 8 );
-        for( auto iter = begin; iter != end; ++iter ) func( *iter );
-      }
+      voices.for_each_in_channel( channel, func );
     }
     template< typename F >
     void for_each_notes( F &&func ) {
-      const std::array< slot_map_t*, 3u > slot_maps{ &note_on_map, &delayed_note_off_map, &note_off_map };
-      for( auto slot_map: slot_maps ){
-        auto begin = slot_map->get< by_note >().begin();
-        auto end = slot_map->get< by_note >().end();
-        for( auto iter = begin; iter != end; ++iter ) func( *iter );
-      }
+      for( auto state: { voice_state_t::note_on, voice_state_t::delayed_note_off, voice_state_t::note_off } )
+        voices.for_each( state, func );
+    }
+    void recalculate_frequency( channel_t channel ) {
+      auto &cst = channel_state[ channel ];
+      for_each_notes_in_channel( channel, [&]( const auto &note_info ) {
+        handler[ note_info.slot ].set_frequency( cst, get_frequency( cst, note_info ) );
+      } );
     }
     void recalculate_volume( channel_t channel ) {
       auto &cst = channel_state[ channel ];
@@ -239,7 +198,7 @@ namespace smfp {
       auto old = cst[ channel_variable_id_t :: name ];\
       auto new_ = ( uint16_t( value ) << 7 ) | ( old & 0x7F ); \
       if( old != new_ ) { \
-        cst[ channel_variable_id_t :: name ] = new_;\
+        cst.set( channel_variable_id_t :: name, new_ );\
         recalculate_volume( channel );\
       } \
     } \
@@ -248,7 +207,7 @@ namespace smfp {
       auto old = cst[ channel_variable_id_t :: name ];\
       auto new_ = ( uint16_t( value ) & 0x7F ) | ( old & 0x3F80 ); \
       if( old != new_ ) { \
-        cst[ channel_variable_id_t :: name ] = new_;\
+        cst.set( channel_variable_id_t :: name, new_ );\
         recalculate_volume( channel );\
       } \
     }
@@ -265,7 +224,7 @@ namespace smfp {
     }
     void channel_pressure( channel_t channel, uint8_t value ) {
       auto &cst = channel_state[ channel ];
-      auto old = cst.pressure;
+      auto old = cst.get_pressure();
       auto new_ = value;
       if( old != new_ ) {
         cst.set_pressure( new_ );
@@ -297,7 +256,7 @@ namespace smfp {
         ( uint16_t( value ) << 7 ) | ( old & 0x7F ) :
         ( uint16_t( value ) & 0x7F ) | ( old & 0x3F80 );
       if( old != new_ ) {
-        cst[ channel_variable_id_t :: portamento_time ] = new_;
+        cst.set( channel_variable_id_t :: portamento_time, new_ );
         if( cst[ channel_variable_id_t :: portamento_switch ] < 0x2000u ) return;
         for_each_notes_in_channel( channel, [&]( const auto &note_info ) {
           handler[ note_info.slot ].set_variable(
@@ -312,7 +271,7 @@ namespace smfp {
       auto old = cst[ channel_variable_id_t:: portamento_switch ];
       auto new_ = ( uint16_t( value ) << 7 ) | ( old & 0x7F );
       if( old != new_ ) {
-        cst[ channel_variable_id_t :: portamento_time ] = new_;
+        cst.set( channel_variable_id_t :: portamento_time, new_ );
         if( cst[ channel_variable_id_t :: portamento_time ] == 0u ) return;
         for_each_notes_in_channel( channel, [&]( const auto &note_info ) {
           handler[ note_info.slot ].set_variable(
@@ -337,7 +296,7 @@ namespace smfp {
         ( uint16_t( value ) << 7 ) | ( old & 0x7F ) : \
         ( uint16_t( value ) & 0x7F ) | ( old & 0x3F80 ); \
       if( old != new_ ) {\
-        cst[ channel_variable_id_t :: name ] = new_;\
+        cst.set( channel_variable_id_t :: name, new_ );\
         for_each_notes_in_channel( channel, [&]( const auto &note_info ) {\
           handler[ note_info.slot ].set_variable (\
             channel_variable_id_t:: name, 0,\
@@ -389,9 +348,9 @@ namespace smfp {
       auto new_ = msb ?
         ( uint16_t( value ) << 7 ) | ( old & 0x7F ) :
         ( uint16_t( value ) & 0x7F ) | ( old & 0x3F80 );
-      cst[ channel_variable_id_t::nrpn ] = new_;
-      cst[ channel_variable_id_t::rpn ] = 0xFFFF;
-      cst[ channel_variable_id_t::data_entry ] = 0xC000;
+      cst.set( channel_variable_id_t::nrpn, new_ );
+      cst.set( channel_variable_id_t::rpn, 0xFFFF );
+      cst.set( channel_variable_id_t::data_entry, 0xC000 );
     }
     void set_rpn_msb ( channel_t channel, uint8_t value ) {
       set_rpn< true >( channel, value );
@@ -406,9 +365,9 @@ namespace smfp {
       auto new_ = msb ?
         ( uint16_t( value ) << 7 ) | ( old & 0x7F ) :
         ( uint16_t( value ) & 0x7F ) | ( old & 0x3F80 );
-      cst[ channel_variable_id_t::rpn ] = new_;
-      cst[ channel_variable_id_t::nrpn ] = 0xFFFF;
-      cst[ channel_variable_id_t::data_entry ] = 0xC000;
+      cst.set( channel_variable_id_t::rpn, new_ );
+      cst.set( channel_variable_id_t::nrpn, 0xFFFF );
+      cst.set( channel_variable_id_t::data_entry, 0xC000 );
     }
     void set_data_entry_msb ( channel_t channel, uint8_t value ) {
       set_data_entry< true >( channel, value );
@@ -418,7 +377,7 @@ namespace smfp {
     }
 #define SMFP_SET_PARAMETER( name ) \
       {\
-        cst[ channel_variable_id_t :: name ] = new_;\
+        cst.set( channel_variable_id_t :: name, new_ );\
         for_each_notes_in_channel( channel, [&]( const auto &note_info ) {\
           handler[ note_info.slot ].set_variable (\
             channel_variable_id_t:: name, 0,\
@@ -428,7 +387,7 @@ namespace smfp {
       }
 #define SMFP_SET_DRUM_PARAMETER( name ) \
       { \
-        cst[ channel_variable_id_t( int( channel_variable_id_t:: name ) + int( cst[ channel_variable_id_t::nrpn ] & 0x7F ) ) ] = new_; \
+        cst.set( channel_variable_id_t( int( channel_variable_id_t:: name ) + int( cst[ channel_variable_id_t::nrpn ] & 0x7F ) ), new_ ); \
         for_each_notes_in_channel( channel, [&]( const auto &note_info ) { \
           handler[ note_info.slot ].set_variable ( \
             channel_variable_id_t:: name, ( cst[ channel_variable_id_t::nrpn ] & 0x7F ), \
@@ -445,20 +404,24 @@ namespace smfp {
         ( uint16_t( value ) << 7 ) | ( old & 0x407F ) :
         ( uint16_t( value ) & 0x7F ) | ( old & 0xBF80 );
       if( old != new_ ) {
-        cst[ channel_variable_id_t::data_entry ] = new_;
+        cst.set( channel_variable_id_t::data_entry, new_ );
         if( ( new_ & 0xC000 ) == 0 ) {
           if( cst[ channel_variable_id_t::rpn ] == 0u )
             SMFP_SET_PARAMETER( pitch_bend_sensitivity )
-          else if( cst[ channel_variable_id_t::rpn ] == 1u )
+          else if( cst[ channel_variable_id_t::rpn ] == 1u ) {
             SMFP_SET_PARAMETER( master_fine_tune )
-          else if( cst[ channel_variable_id_t::rpn ] == 2u )
+            recalculate_frequency( channel );
+          }
+          else if( cst[ channel_variable_id_t::rpn ] == 2u ) {
             SMFP_SET_PARAMETER( master_coarse_tune )
+            recalculate_frequency( channel );
+          }
           else if( cst[ channel_variable_id_t::rpn ] == 5u )
             SMFP_SET_PARAMETER( modulation_depth_range )
           else if( cst[ channel_variable_id_t::rpn ] == 7u ) {
-            cst[ channel_variable_id_t::rpn ] = 0xFFFF;
-            cst[ channel_variable_id_t::nrpn ] = 0xFFFF;
-            cst[ channel_variable_id_t::data_entry ] = 0xC000;
+            cst.set( channel_variable_id_t::rpn, 0xFFFF );
+            cst.set( channel_variable_id_t::nrpn, 0xFFFF );
+            cst.set( channel_variable_id_t::data_entry, 0xC000 );
           }
           else if( cst[ channel_variable_id_t::rpn ] == 5u )
             SMFP_SET_PARAMETER( modulation_depth_range )
@@ -603,13 +566,11 @@ namespace smfp {
     }
     void pitch_bend( channel_t channel, int16_t value ) {
       auto &cst = channel_state[ channel ];
-      auto old = cst.pitch_bend;
+      auto old = cst.get_pitch_bend_value();
       auto new_ = value;
       if( old != new_ ) {
         cst.set_pitch_bend( new_ );
-        for_each_notes_in_channel( channel, [&]( const auto &note_info ) {
-          handler[ note_info.slot ].set_frequency( cst, get_frequency( cst, note_info ) );
-        });
+        recalculate_frequency( channel );
       }
     }
     template< typename Iterator >
@@ -673,9 +634,9 @@ namespace smfp {
       if( begin == end ) {
         throw invalid_midi_message();
       }
-      auto cur = begin;
-      auto length = *cur - 1;
-      ++cur;
+      // 長さはSMFと同じ可変長数値で、終わりのF7を含む
+      auto [cur,length_with_f7] = decode_variable_length_quantity( begin, end );
+      const auto length = int( length_with_f7 ) - 1;
       if( std::distance( cur, end ) < length ) {
         throw invalid_midi_message();
       }
@@ -742,10 +703,7 @@ namespace smfp {
       }
     }
     Handler &handler;
-    slot_map_t note_on_map;
-    slot_map_t note_off_map;
-    slot_map_t delayed_note_off_map;
-    std::stack< slot_t > available_slots;
+    voice_allocator_t voices;
     std::vector< channel_state_t > channel_state;
     uint64_t note_count;
     global_state_t global_state;
@@ -4,6 +4,8 @@
 #include <cmath>
 #include <chrono>
 #include <limits>
+#include <cstdint>
+#include <vector>
 
 namespace smfp {
   class mixer_t {
@@ -20,12 +22,11 @@ namespace smfp {
           env_sum += std::pow( 10.f, env / 40.f );
         }
       }
+      return ( *this )( val_sum, env_sum );
+    }
+    float operator()( float val_sum, float env_sum ) {
       auto env_sum_db = 40.f * std::log10( env_sum );
-      requested_scale = get_scale( env_sum_db );
-      if( current_scale < requested_scale )
-        current_scale += ( requested_scale - current_scale ) * spms;
-      else
-        current_scale += ( requested_scale - current_scale ) * spms / 100.f;
+      update_scale( env_sum_db );
       float value = val_sum * std::pow( 10.f, -current_scale / 40.f );
       if( env_sum_db - current_scale > 0.f && value > 1.f ) {
         current_scale = env_sum_db;
@@ -33,17 +34,43 @@ namespace smfp {
       }
       return val_sum * std::pow( 10.f, -current_scale / 40.f );
     }
+    // ボイス毎にブロック全体を描画して足し合わせるので、楽器の呼び分けはボイス毎に1回で済む
+    // 各サンプルの和はボイスの順に足すので、1サンプルずつ描画した場合と同じ値になる
     template< typename Channels, typename Iterator >
     void operator()( Channels &channels, Iterator begin, Iterator end ) {
-      for( auto iter = begin; iter != end; ++iter )
-        *iter = ( *this )( channels );
+      const size_t count = std::distance( begin, end );
+      val_buf.assign( count, 0.f );
+      env_buf.assign( count, 0.f );
+      for( auto &channel: channels )
+        channel.mix( step, val_buf.data(), env_buf.data(), count );
+      for( size_t i = 0u; i != count; ++i, ++begin )
+        *begin = ( *this )( val_buf[ i ], env_buf[ i ] );
+    }
+    // 値を計算せずにAGCを1サンプル進める
+    // 振幅の制限が働き得る場合は値が無いと同じ結果にできないのでfalseを返す
+    bool advance( float env_sum ) {
+      const auto env_sum_db = 40.f * std::log10( env_sum );
+      update_scale( env_sum_db );
+      return !( env_sum_db - current_scale > 0.f );
     }
+    // 音を出さずにエンベロープの和がenv_sumのままcountサンプル経った状態にする
+    void skip( float env_sum, uint64_t count );
   public:
     float get_scale( float x ) const;
     float current_scale;
     float requested_scale;
     std::chrono::nanoseconds step;
     float spms;
+  private:
+    void update_scale( float env_sum_db ) {
+      requested_scale = get_scale( env_sum_db );
+      if( current_scale < requested_scale )
+        current_scale += ( requested_scale - current_scale ) * spms;
+      else
+        current_scale += ( requested_scale - current_scale ) * spms / 100.f;
+    }
+    std::vector< float > val_buf;
+    std::vector< float > env_buf;
   };
 }
 
@@ -1,6 +1,7 @@
 #ifndef SMFP_MULTI_INSTRUMENTS_HPP
 #define SMFP_MULTI_INSTRUMENTS_HPP
 
+#include <algorithm>
 #include <utility>
 #include <boost/container/flat_map.hpp>
 #include <boost/spirit/include/qi.hpp>
@@ -80,6 +81,10 @@ namespace smfp {
       if( secondary != bank.end() ) return secondary->second;
       return bank.begin()->second;
     }
+    // バンクの全ての楽器を加算合成で鳴らせるか
+    bool has_partials() const {
+      return std::all_of( bank.begin(), bank.end(), []( const auto &v ) { return v.second->has_partials(); } );
+    }
     nlohmann::json dump() const {
       auto root = nlohmann::json::object();
       for( const auto &[key,value]: bank ) {
@@ -98,7 +103,7 @@ namespace smfp {
   public:
     using config_type = multi_instruments_config_t< typename T::config_type >;
     multi_instrument_t( const std::shared_ptr< multi_instruments_config_t< typename T::config_type > > &config_ ) :
-      config( config_ ), backend( config_->get() ) {}
+      config( config_ ), current( config_->get() ), backend( current ) {}
     nlohmann::json dump() const {
       return {
         { "config", config->dump() },
@@ -106,6 +111,11 @@ namespace smfp {
       };
     }
     void note_on( const channel_state_t &cst, const active_note_t &nst ) {
+      const auto next = config->get( cst );
+      if( next != current ) {
+        current = next;
+        backend.set_config( cst, current );
+      }
       backend.note_on( cst, nst );
     }
     void note_off( const channel_state_t &cst ) {
@@ -124,11 +134,30 @@ namespace smfp {
     void operator()( std::chrono::nanoseconds step, Iterator begin, Iterator end ) {
       return backend( step, begin, end );
     }
+    void mix( std::chrono::nanoseconds step, float *val, float *env, size_t count ) {
+      backend.mix( step, val, env, count );
+    }
+    void trace( std::chrono::nanoseconds step, float *env, size_t count ) {
+      backend.trace( step, env, count );
+    }
+    std::tuple< float, float > advance( std::chrono::nanoseconds step ) {
+      return backend.advance( step );
+    }
+    std::tuple< float, float > advance( std::chrono::nanoseconds step, uint64_t count ) {
+      return backend.advance( step, count );
+    }
+    std::tuple< float, float > skip( std::chrono::nanoseconds step, uint64_t count ) {
+      return backend.skip( step, count );
+    }
+    auto get_partials() const {
+      return backend.get_partials();
+    }
     void set_variable( channel_variable_id_t id, note_t at, const channel_state_t &cst ) {
       backend.set_variable( id, at, cst );
     }
     void set_program( const channel_state_t &cst,  uint8_t prog ) {
-      backend.set_config( cst, config->get( cst ) );
+      current = config->get( cst );
+      backend.set_config( cst, current );
       backend.clear( cst );
       backend.set_program( cst, prog );
     }
@@ -144,6 +173,7 @@ namespace smfp {
     }
   private:
     std::shared_ptr< config_type > config;
+    std::shared_ptr< typename T::config_type > current;
     T backend;
   };
 }
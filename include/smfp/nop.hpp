@@ -0,0 +1,187 @@
+#ifndef SMFP_NOP_HPP
+#define SMFP_NOP_HPP
+
+#include <cmath>
+#include <array>
+#include <chrono>
+#include <limits>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <algorithm>
+#include <stamp/setter.hpp>
+#include <smfp/channel_state.hpp>
+#include <smfp/active_note.hpp>
+#include <smfp/exceptions.hpp>
+#include <smfp/get_node.hpp>
+#include <smfp/get_volume.hpp>
+#include <smfp/fmeg.hpp>
+#include <smfp/2op.hpp>
+
+namespace smfp {
+  // N個のオペレータが互いを変調できるFM音源
+  // operatorsのi番目の出力はoutputのi番目の重みで出力に加わる
+  template< size_t operator_count >
+  struct fm_nop_config_t {
+    fm_nop_config_t() {
+      std::fill( output.begin(), output.end(), 0.f );
+    }
+    fm_nop_config_t( const nlohmann::json &config ) {
+      const auto operators_ = get_node( config, "operators" );
+      if( !operators_.is_array() ) throw invalid_instrument_config( "fm_nop_config_t: operatorsが配列でない" );
+      if( operators_.size() != operator_count ) throw invalid_instrument_config( "fm_nop_config_t: operatorsのサイズがオペレータ数と一致しない" );
+      for( size_t i = 0u; i != operator_count; ++i )
+        operators[ i ] = fmeg_config_t< operator_count >( operators_[ i ] );
+      const auto output_ = get_node( config, "output" );
+      if( !output_.is_array() ) throw invalid_instrument_config( "fm_nop_config_t: outputが配列でない" );
+      if( output_.size() != operator_count ) throw invalid_instrument_config( "fm_nop_config_t: outputのサイズがオペレータ数と一致しない" );
+      for( size_t i = 0u; i != operator_count; ++i ) {
+        if( !output_[ i ].is_number() ) throw invalid_instrument_config( "fm_nop_config_t: outputの要素が数値でない" );
+        output[ i ] = float( output_[ i ] );
+      }
+    }
+    nlohmann::json dump() const {
+      auto operators_ = nlohmann::json::array();
+      for( const auto &v: operators )
+        operators_.push_back( v.dump() );
+      return {
+        { "operators", operators_ },
+        { "output", output }
+      };
+    }
+    LIBSTAMP_SETTER( operators )
+    LIBSTAMP_SETTER( output )
+    std::array< fmeg_config_t< operator_count >, operator_count > operators;
+    std::array< float, operator_count > output;
+  };
+  template< size_t operator_count >
+  fm_nop_config_t< operator_count > lerp(
+    const fm_nop_config_t< operator_count > &l,
+    const fm_nop_config_t< operator_count > &r,
+    float pos
+  ) {
+    fm_nop_config_t< operator_count > temp;
+    for( size_t i = 0u; i != operator_count; ++i ) {
+      temp.operators[ i ] = lerp( l.operators[ i ], r.operators[ i ], pos );
+      temp.output[ i ] = std::lerp( l.output[ i ], r.output[ i ], pos );
+    }
+    return temp;
+  }
+  template< size_t operator_count >
+  class fm_nop_t {
+  public:
+    using config_type = fm_nop_config_t< operator_count >;
+    static std::string get_type_name() {
+      return std::to_string( operator_count ) + "op";
+    }
+    // 2オペレータの形では表せないので加算合成では鳴らせない
+    static constexpr bool has_partials = false;
+    fm_nop_t( const fm_nop_config_t< operator_count > &config ) :
+      fm_nop_t( config, std::make_index_sequence< operator_count >() ) {}
+    fm_nop_t( const nlohmann::json &config ) :
+      fm_nop_t( fm_nop_config_t< operator_count >( config ) ) {}
+    nlohmann::json dump() const {
+      auto operators_ = nlohmann::json::array();
+      for( const auto &v: operators )
+        operators_.push_back( v.dump() );
+      return {
+        { "operators", operators_ },
+        { "output", output }
+      };
+    }
+    void set_config( const channel_state_t &cst, const fm_nop_config_t< operator_count > &config ) {
+      for( size_t i = 0u; i != operator_count; ++i )
+        operators[ i ].set_config( cst, config.operators[ i ] );
+      output = config.output;
+    }
+    void note_on( const channel_state_t &cst, const active_note_t &nst ) {
+      if( ( nst.channel_note >> 8 ) == 10 ) return;
+      const auto volume = get_volume( cst, nst );
+      for( size_t i = 0u; i != operator_count; ++i ) {
+        operators[ i ].note_on( cst, nst );
+        operators[ i ].set_volume( cst, ( output[ i ] != 0.f ) ? volume : 0.f );
+      }
+      std::fill( values.begin(), values.end(), 0.f );
+    }
+    void note_off( const channel_state_t &cst ) {
+      for( auto &op: operators ) op.note_off( cst );
+    }
+    void clear( const channel_state_t &cst ) {
+      for( auto &op: operators ) op.clear( cst );
+    }
+    void set_frequency( const channel_state_t &cst, float freq ) {
+      for( auto &op: operators ) op.set_frequency( cst, freq );
+    }
+    // 番号の小さいオペレータの出力はそのサンプルの値を、それ以外は1サンプル前の値を変調に使う
+    std::tuple< float, float > operator()( std::chrono::nanoseconds step ) {
+      float envelope = -std::numeric_limits< float >::infinity();
+      float value = 0.f;
+      for( size_t i = 0u; i != operator_count; ++i ) {
+        const auto [env,val] = operators[ i ]( step, values.begin() );
+        values[ i ] = val;
+        if( output[ i ] != 0.f ) {
+          envelope = std::max( envelope, env );
+          value += output[ i ] * val;
+        }
+      }
+      return std::make_tuple( envelope, value );
+    }
+    template< typename Iterator >
+    void operator()( std::chrono::nanoseconds step, Iterator begin, Iterator end ) {
+      for( auto iter = begin; iter != end; ++iter )
+        *iter = std::get< 1 >( (*this)( step ) );
+    }
+    std::tuple< float, float > advance( std::chrono::nanoseconds step ) {
+      const auto envelope = std::get< 0 >( (*this)( step ) );
+      return std::make_tuple( envelope, std::pow( 10.f, envelope / 40.f ) );
+    }
+    // 全てのオペレータが1サンプル前の出力で変調されるので、描画と同じ状態にするには波形が要る
+    std::tuple< float, float > trace( std::chrono::nanoseconds step ) {
+      return advance( step );
+    }
+    // 最後のサンプルだけは波形を計算し、次のサンプルの変調に使う1サンプル前の出力を揃える
+    std::tuple< float, float > advance( std::chrono::nanoseconds step, uint64_t count ) {
+      if( count == 0u ) return std::make_tuple( -std::numeric_limits< float >::infinity(), 0.f );
+      for( auto &op: operators ) op.advance( step, count - 1u );
+      return advance( step );
+    }
+    std::tuple< float, float > skip( std::chrono::nanoseconds step, uint64_t count ) {
+      float envelope = -std::numeric_limits< float >::infinity();
+      for( size_t i = 0u; i != operator_count; ++i ) {
+        const auto env = std::get< 0 >( operators[ i ].skip( step, count ) );
+        if( output[ i ] != 0.f ) envelope = std::max( envelope, env );
+      }
+      return std::make_tuple( envelope, std::pow( 10.f, envelope / 40.f ) );
+    }
+    fm_2op_nofb_partials_t get_partials() const {
+      return fm_2op_nofb_partials_t();
+    }
+    void set_variable( channel_variable_id_t /*id*/, note_t /*at*/, const channel_state_t &/*cst*/ ) {}
+    void set_program( const channel_state_t&,  uint8_t ) {}
+    void set_volume( const channel_state_t &cst, float value ) {
+      for( size_t i = 0u; i != operator_count; ++i )
+        if( output[ i ] != 0.f ) operators[ i ].set_volume( cst, value );
+    }
+    template< typename Iterator >
+    void system_exclusive( const channel_state_t &, Iterator, Iterator ) {
+    }
+    bool is_end() const {
+      for( size_t i = 0u; i != operator_count; ++i )
+        if( output[ i ] != 0.f && !operators[ i ].is_end() ) return false;
+      return true;
+    }
+  private:
+    template< size_t ...I >
+    fm_nop_t( const fm_nop_config_t< operator_count > &config, std::index_sequence< I... > ) :
+      operators{ fmeg_t< operator_count >( config.operators[ I ] )... },
+      output( config.output ) {
+      std::fill( values.begin(), values.end(), 0.f );
+    }
+    std::array< fmeg_t< operator_count >, operator_count > operators;
+    std::array< float, operator_count > output;
+    std::array< float, operator_count > values;
+  };
+}
+
+#endif
+
@@ -0,0 +1,39 @@
+#ifndef SMFP_SCHEDULE_HPP
+#define SMFP_SCHEDULE_HPP
+
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+
+namespace smfp {
+  // トラックを1ブロック分進める
+  // ブロックを次のイベントの位置で区切り、区間[from,to)の描画をrenderに任せてからイベントを渡すので
+  // イベントはブロックの境界ではなく発生したサンプルで適用される
+  template< typename Tracks, typename Handler, typename Render >
+  void play_block(
+    Tracks &tracks,
+    Handler &handler,
+    std::chrono::nanoseconds step,
+    size_t block_size,
+    Render &&render
+  ) {
+    size_t done = 0u;
+    while( done != block_size ) {
+      size_t span = block_size - done;
+      if( !tracks.end() ) {
+        const uint64_t distance = ( tracks.get_distance().count() + step.count() - 1u ) / step.count();
+        // 今のサンプルで発生するイベントは描画する前に適用する
+        if( distance == 0u ) {
+          tracks( std::chrono::nanoseconds( 0 ), handler );
+          continue;
+        }
+        span = size_t( std::min( uint64_t( span ), distance ) );
+      }
+      render( done, done + span );
+      tracks( step * span, handler );
+      done += span;
+    }
+  }
+}
+
+#endif
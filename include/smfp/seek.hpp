@@ -0,0 +1,62 @@
+#ifndef SMFP_SEEK_HPP
+#define SMFP_SEEK_HPP
+
+#include <cmath>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include <cstdint>
+#include <smfp/mixer.hpp>
+#include <smfp/schedule.hpp>
+#include <smfp/coalesce.hpp>
+
+namespace smfp {
+  // 音を出さずにsamplesサンプル分再生位置を進め、実際に進めたサンプル数を返す
+  // イベントの間はボイスの状態を解析的に飛ばし、ミキサーのAGCは到達時点の定常値にする
+  // play_blockと同じようにイベントの位置で区切り、コントローラの値はブロック毎にまとめて適用する
+  template< typename Tracks, typename Parser, typename Handler >
+  uint64_t seek(
+    Tracks &tracks,
+    Parser &parser,
+    Handler &handlers,
+    mixer_t &mixer,
+    std::chrono::nanoseconds step,
+    size_t block_size,
+    uint64_t samples
+  ) {
+    controller_coalescer_t coalescer( parser );
+    uint64_t done = 0u;
+    float env_sum = 0.f;
+    const auto skip = [&]( uint64_t count ) {
+      env_sum = 0.f;
+      for( auto &h: handlers ) {
+        const auto env = std::get< 0 >( h.skip( step, count ) );
+        if( env != -std::numeric_limits< float >::infinity() )
+          env_sum += std::pow( 10.f, env / 40.f );
+      }
+    };
+    while( done != samples && !tracks.end() ) {
+      // 次のイベントが発生するブロックの手前まではまとめて進める
+      const uint64_t distance = ( tracks.get_distance().count() + step.count() - 1u ) / step.count();
+      const uint64_t empty = std::min( ( samples - done ) / block_size, distance ? ( distance - 1u ) / block_size : uint64_t( 0u ) );
+      if( empty ) {
+        skip( empty * block_size );
+        tracks( step * ( empty * block_size ), coalescer );
+        done += empty * block_size;
+        continue;
+      }
+      // 最後のブロックは目的のサンプルで終わるように短くする
+      const auto size = size_t( std::min( uint64_t( block_size ), samples - done ) );
+      play_block( tracks, coalescer, step, size, [&]( size_t from, size_t to ) {
+        skip( to - from );
+      } );
+      coalescer.flush();
+      done += size;
+    }
+    mixer.requested_scale = mixer.get_scale( 40.f * std::log10( env_sum ) );
+    mixer.current_scale = mixer.requested_scale;
+    return done;
+  }
+}
+
+#endif
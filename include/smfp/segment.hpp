@@ -0,0 +1,141 @@
+#ifndef SMFP_SEGMENT_HPP
+#define SMFP_SEGMENT_HPP
+
+#include <cmath>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <smfp/mixer.hpp>
+#include <smfp/midi_parser.hpp>
+#include <smfp/schedule.hpp>
+#include <smfp/coalesce.hpp>
+
+namespace smfp {
+  // 区間の先頭でのシーケンサ、パーサ、ボイス、ミキサーの状態
+  template< typename Tracks, typename Handler >
+  struct segment_snapshot_t {
+    segment_snapshot_t(
+      const Tracks &tracks_,
+      const Handler &handlers_,
+      const midi_parser_t< Handler > &parser_,
+      const mixer_t &mixer_
+    ) : tracks( tracks_ ), handlers( handlers_ ), parser( handlers, parser_ ), mixer( mixer_ ), length( 0u ) {}
+    segment_snapshot_t( const segment_snapshot_t& ) = delete;
+    segment_snapshot_t &operator=( const segment_snapshot_t& ) = delete;
+    Tracks tracks;
+    Handler handlers;
+    midi_parser_t< Handler > parser;
+    mixer_t mixer;
+    size_t length;
+  };
+  // 波形を計算せずにボイスとミキサーのAGCをcountサンプル進める
+  // エンベロープとAGCは描画と同じく1サンプルずつ進めるので、区間の先頭の状態は逐次描画と同じになる
+  // AGCの振幅の制限が働き得るサンプルがあった場合はfalseを返す
+  template< typename Handler >
+  bool advance_span( Handler &handlers, mixer_t &mixer, std::chrono::nanoseconds step, std::vector< float > &env_sum, size_t count ) {
+    env_sum.assign( count, 0.f );
+    for( auto &h: handlers )
+      h.trace( step, env_sum.data(), count );
+    for( size_t i = 0u; i != count; ++i )
+      if( !mixer.advance( env_sum[ i ] ) ) return false;
+    return true;
+  }
+  // advance_spanの近似版
+  // エンベロープはイベントの間を解析的に進め、AGCは区間の終わりのエンベロープの和で進める
+  // 位相は描画と同じ計算で進めるので、区間の繋ぎ目で波形が途切れない
+  template< typename Handler >
+  void advance_span_approximately( Handler &handlers, mixer_t &mixer, std::chrono::nanoseconds step, size_t count ) {
+    float env_sum = 0.f;
+    for( auto &h: handlers ) {
+      const auto env = std::get< 0 >( h.advance( step, count ) );
+      if( env != -std::numeric_limits< float >::infinity() )
+        env_sum += std::pow( 10.f, env / 40.f );
+    }
+    mixer.skip( env_sum, count );
+  }
+  // 制御だけを進める事前パスで区間の先頭の状態を記録し、区間を並列に描画して順に繋げる
+  // スナップショットのメモリを抑えるため、スレッド数分の区間ごとに事前パスと描画を繰り返す
+  // 次の区間の事前パスは1つのスレッドで今の区間の描画と並行して行う
+  // approximateを指定すると事前パスにadvance_span_approximatelyを使い、逐次描画と同じ結果にならない代わりに速くなる
+  template< typename Tracks, typename Handler, typename Sink >
+  void render_segments(
+    Tracks tracks,
+    Handler handlers,
+    std::chrono::nanoseconds step,
+    size_t block_size,
+    size_t segment_size,
+    mixer_t &mixer,
+    Sink &sink,
+    bool approximate = false
+  ) {
+    using snapshot_t = segment_snapshot_t< Tracks, Handler >;
+    midi_parser_t< Handler > parser( handlers );
+    controller_coalescer_t coalescer( parser );
+    const size_t width = std::max( std::thread::hardware_concurrency(), 1u );
+    Handler saved_handlers;
+    std::vector< float > scratch;
+    // 振幅の制限が働き得る区間は、区間の先頭の状態に戻して実際に描画した結果を捨てる
+    const auto advance = [&]( size_t count ) {
+      if( approximate ) {
+        advance_span_approximately( handlers, mixer, step, count );
+        return;
+      }
+      saved_handlers = handlers;
+      const auto current_scale = mixer.current_scale;
+      const auto requested_scale = mixer.requested_scale;
+      if( advance_span( handlers, mixer, step, scratch, count ) ) return;
+      handlers = saved_handlers;
+      mixer.current_scale = current_scale;
+      mixer.requested_scale = requested_scale;
+      scratch.resize( count );
+      mixer( handlers, scratch.begin(), scratch.end() );
+    };
+    const auto prepass = [&]( std::vector< std::unique_ptr< snapshot_t > > &segments ) {
+      segments.clear();
+      while( segments.size() != width && !tracks.end() ) {
+        segments.emplace_back( new snapshot_t( tracks, handlers, parser, mixer ) );
+        size_t length = 0u;
+        for( ; length != segment_size && !tracks.end(); ++length ) {
+          play_block( tracks, coalescer, step, block_size, [&]( size_t from, size_t to ) {
+            advance( to - from );
+          } );
+          coalescer.flush();
+        }
+        segments.back()->length = length;
+      }
+    };
+    std::vector< std::unique_ptr< snapshot_t > > segments;
+    std::vector< std::unique_ptr< snapshot_t > > next;
+    std::vector< std::vector< float > > buffers;
+    prepass( segments );
+    while( !segments.empty() ) {
+      buffers.resize( segments.size() );
+#pragma omp parallel
+      {
+#pragma omp single nowait
+        prepass( next );
+#pragma omp for schedule( dynamic )
+        for( size_t i = 0; i < segments.size(); ++i ) {
+          auto &s = *segments[ i ];
+          controller_coalescer_t segment_coalescer( s.parser );
+          buffers[ i ].resize( s.length * block_size );
+          for( size_t b = 0u; b != s.length; ++b ) {
+            const auto head = std::next( buffers[ i ].begin(), b * block_size );
+            play_block( s.tracks, segment_coalescer, step, block_size, [&]( size_t from, size_t to ) {
+              s.mixer( s.handlers, std::next( head, from ), std::next( head, to ) );
+            } );
+            segment_coalescer.flush();
+          }
+        }
+      }
+      for( size_t i = 0u; i != segments.size(); ++i )
+        sink( buffers[ i ] );
+      std::swap( segments, next );
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef SMFP_SINE_HPP
+#define SMFP_SINE_HPP
+
+#include <chrono>
+#include <string>
+#include <tuple>
+#include <smfp/channel_state.hpp>
+#include <smfp/active_note.hpp>
+#include <smfp/fmeg.hpp>
+#include <smfp/2op.hpp>
+
+namespace smfp {
+  // 変調のない1オペレータの音源
+  class sine_t {
+  public:
+    using config_type = fmeg_config_t< 0u >;
+    static std::string get_type_name() {
+      return "sine";
+    }
+    static constexpr bool has_partials = true;
+    sine_t( const fmeg_config_t< 0u > &config );
+    sine_t( const nlohmann::json &config );
+    nlohmann::json dump() const;
+    void set_config( const channel_state_t &cst, const fmeg_config_t< 0u > &config );
+    void note_on( const channel_state_t &cst, const active_note_t &nst );
+    void note_off( const channel_state_t &cst );
+    void clear( const channel_state_t &cst );
+    void set_frequency( const channel_state_t &cst, float freq );
+    std::tuple< float, float > operator()( std::chrono::nanoseconds step );
+    template< typename Iterator >
+    void operator()( std::chrono::nanoseconds step, Iterator begin, Iterator end ) {
+      for( auto iter = begin; iter != end; ++iter )
+        *iter = std::get< 1 >( (*this)( step ) );
+    }
+    std::tuple< float, float > advance( std::chrono::nanoseconds step );
+    std::tuple< float, float > advance( std::chrono::nanoseconds step, uint64_t count );
+    std::tuple< float, float > trace( std::chrono::nanoseconds step );
+    std::tuple< float, float > skip( std::chrono::nanoseconds step, uint64_t count );
+    fm_2op_nofb_partials_t get_partials() const;
+    void set_variable( channel_variable_id_t /*id*/, note_t /*at*/, const channel_state_t &/*cst*/ ) {}
+    void set_program( const channel_state_t&,  uint8_t ) {}
+    void set_volume( const channel_state_t &cst, float value );
+    template< typename Iterator >
+    void system_exclusive( const channel_state_t &, Iterator, Iterator ) {
+    }
+    bool is_end() const;
+  private:
+    fmeg_t< 0u > op;
+  };
+}
+
+#endif
+
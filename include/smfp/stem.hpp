@@ -0,0 +1,122 @@
+#ifndef SMFP_STEM_HPP
+#define SMFP_STEM_HPP
+
+#include <chrono>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <utility>
+#include <cstdint>
+#include <algorithm>
+#include <boost/container/flat_map.hpp>
+#include <smfp/exceptions.hpp>
+#include <smfp/mixer.hpp>
+#include <smfp/voice_job.hpp>
+
+namespace smfp {
+  // 描画結果が変わる変更をしたら増やして、前の版で作ったstemを使わないようにする
+  constexpr uint64_t stem_version = 2u;
+  uint64_t fnv1a( const void *data, size_t size, uint64_t hash = 0xcbf29ce484222325ull );
+  uint64_t fnv1a( const std::string &data, uint64_t hash = 0xcbf29ce484222325ull );
+  std::string get_stem_filename( const std::string &dir, uint64_t hash );
+  // 一部のジョブだけを描画した値とエンベロープの和をタイル毎に受け取ってファイルに書く
+  // AGCは全ボイスのエンベロープの和で決まるので両方を残す
+  // 鳴っていない前後の区間は保存しない
+  class stem_writer_t {
+  public:
+    stem_writer_t( const std::string &filename_, uint64_t context );
+    stem_writer_t( const stem_writer_t& ) = delete;
+    stem_writer_t &operator=( const stem_writer_t& ) = delete;
+    void operator()( uint64_t tile_begin, const std::vector< float > &val, const std::vector< float > &env );
+    // 長さを書き込んでから正しい名前に置き換える
+    void close();
+  private:
+    std::string filename;
+    std::string temp;
+    std::ofstream file;
+    bool started;
+    uint64_t begin;
+    // 最後に鳴っていたサンプルまでの数
+    uint64_t size;
+    std::vector< float > buffer;
+  };
+  // stemを先頭から順にタイル毎に読む
+  class stem_reader_t {
+  public:
+    stem_reader_t() : begin( 0u ), size( 0u ), position( 0u ) {}
+    stem_reader_t( const stem_reader_t& ) = delete;
+    stem_reader_t &operator=( const stem_reader_t& ) = delete;
+    // 前の版のstemや壊れたstemならfalseを返す
+    bool open( const std::string &filename );
+    // [tile_begin,tile_begin+length)の値をval、エンベロープをenvに足す
+    // タイルは先頭から隙間なく順に渡す
+    void add( uint64_t tile_begin, size_t length, float *val, float *env );
+  private:
+    std::ifstream file;
+    uint64_t begin;
+    uint64_t size;
+    uint64_t position;
+    std::vector< float > buffer;
+  };
+  // contextが同じでusedに含まれないstemと、前の版で作ったstemを消す
+  void evict_stems( const std::string &dir, uint64_t context, const std::vector< std::string > &used );
+  // 同じ音色を使うジョブ毎にstemを作り、前回から音色が変わっていないものはキャッシュから読む
+  // classifyはジョブが使う音色を表す文字列を返す
+  // contextには音色以外で描画結果を左右するもの(SMFやステップ)のハッシュを渡す
+  template< typename Instrument, typename Classify, typename Sink >
+  std::pair< size_t, size_t > render_voice_jobs_incremental(
+    const voice_jobs_t &jobs,
+    const Instrument &prototype,
+    std::chrono::nanoseconds step,
+    mixer_t &mixer,
+    Sink &sink,
+    const std::string &cache_dir,
+    uint64_t context,
+    Classify classify,
+    size_t tile_size = 65536u
+  ) {
+    boost::container::flat_map< std::string, std::vector< size_t > > groups;
+    for( size_t i = 0; i != jobs.jobs.size(); ++i )
+      groups[ classify( jobs.jobs[ i ] ) ].push_back( i );
+    std::vector< std::string > filenames;
+    filenames.reserve( groups.size() );
+    std::vector< stem_reader_t > stems( groups.size() );
+    size_t rendered = 0u;
+    for( const auto &[patch,selected]: groups ) {
+      auto hash = fnv1a( &stem_version, sizeof( stem_version ), context );
+      hash = fnv1a( patch, hash );
+      hash = fnv1a( selected.data(), selected.size() * sizeof( size_t ), hash );
+      filenames.push_back( get_stem_filename( cache_dir, hash ) );
+      if( !stems[ filenames.size() - 1u ].open( filenames.back() ) ) {
+        {
+          stem_writer_t writer( filenames.back(), context );
+          sum_voice_jobs( jobs, selected, prototype, step, writer, tile_size );
+          writer.close();
+        }
+        if( !stems[ filenames.size() - 1u ].open( filenames.back() ) )
+          throw unable_to_write_stem( "render_voice_jobs_incremental: 書き込んだstemを読めない" );
+        ++rendered;
+      }
+    }
+    evict_stems( cache_dir, context, filenames );
+    // 全曲分を持たずにタイル毎にstemを足してAGCを適用する
+    std::vector< float > val;
+    std::vector< float > env;
+    std::vector< float > output;
+    for( uint64_t tile_begin = 0; tile_begin < jobs.length; tile_begin += tile_size ) {
+      const size_t length = std::min( tile_begin + tile_size, jobs.length ) - tile_begin;
+      val.assign( length, 0.f );
+      env.assign( length, 0.f );
+      for( auto &stem: stems )
+        stem.add( tile_begin, length, val.data(), env.data() );
+      output.resize( length );
+      for( size_t t = 0; t != length; ++t )
+        output[ t ] = mixer( val[ t ], env[ t ] );
+      sink( output );
+    }
+    return std::make_pair( rendered, stems.size() );
+  }
+}
+
+#endif
+
@@ -0,0 +1,162 @@
+#ifndef SMFP_STREAM_HPP
+#define SMFP_STREAM_HPP
+
+#include <cstdint>
+#include <array>
+#include <chrono>
+#include <istream>
+#include <iterator>
+#include <tuple>
+#include <vector>
+#include <smfp/header.hpp>
+#include <smfp/exceptions.hpp>
+#include <smfp/decode_integer.hpp>
+#include <smfp/tempo_map.hpp>
+
+namespace smfp {
+  // パイプなど先頭に戻れない入力からSMFのヘッダを読む
+  inline smf_header_t read_smf_header( std::istream &stream ) {
+    std::array< uint8_t, 14u > buf;
+    if( !stream.read( reinterpret_cast< char* >( buf.data() ), buf.size() ) ) throw invalid_smf_header();
+    return std::get< 1 >( decode_smf_header( buf.begin(), buf.end() ) );
+  }
+  // 入力の残りを全てメモリに読み込む
+  // 複数のトラックを並べて再生するにはトラックが揃っている必要がある
+  inline std::vector< uint8_t > read_stream( std::istream &stream ) {
+    return std::vector< uint8_t >( std::istreambuf_iterator< char >( stream ), std::istreambuf_iterator< char >() );
+  }
+  // 1トラックのSMFを入力から1イベントずつ読みながら再生する
+  // 次のイベント1つ分だけを先読みするので、入力が書き終わる前に再生を始められる
+  // smf_timeline_player_tと同じインターフェースを持つ
+  class smf_stream_player_t {
+  public:
+    smf_stream_player_t(
+      std::istream &stream_,
+      const smf_header_t &header_,
+      std::chrono::nanoseconds step_
+    ) :
+      stream( &stream_ ), step( step_ ),
+      left( 0u ), tick( 0u ), tempo( header_ ),
+      position( 0u ), overrun( 0u ), current_status_byte( 0u ), pending( false ), finished( false ) {
+      std::array< uint8_t, 8u > buf;
+      if( !stream->read( reinterpret_cast< char* >( buf.data() ), buf.size() ) ) {
+        finished = true;
+        return;
+      }
+      constexpr std::array< unsigned char, 4u > magic{ 'M', 'T', 'r', 'k' };
+      if( !std::equal( magic.begin(), magic.end(), buf.begin() ) ) throw invalid_smf_track();
+      left = std::get< 1 >( decode_integer< uint32_t >( std::next( buf.begin(), 4 ), buf.end() ) );
+      read_event();
+    }
+    template< typename Handler >
+    void operator()( std::chrono::nanoseconds adv, Handler &handler ) {
+      const uint64_t total = adv.count() + overrun;
+      position += total / step.count();
+      overrun = total % step.count();
+      while( pending && time <= position ) {
+        handler( status, message.data(), std::next( message.data(), message.size() ) );
+        read_event();
+      }
+    }
+    std::chrono::nanoseconds get_distance() const {
+      if( end() ) return std::chrono::nanoseconds( 0 );
+      const uint64_t next = time * step.count();
+      const uint64_t now = position * step.count() + overrun;
+      return std::chrono::nanoseconds( next > now ? next - now : 0u );
+    }
+    bool end() const {
+      return !pending;
+    }
+  private:
+    uint8_t get() {
+      if( left == 0u ) throw invalid_smf_track();
+      const auto c = stream->get();
+      if( c == std::istream::traits_type::eof() ) throw invalid_smf_track();
+      --left;
+      return uint8_t( c );
+    }
+    // トラックの終端かEnd of Trackに達したらpendingを下ろす
+    void read_event() {
+      pending = false;
+      while( !finished ) {
+        if( left == 0u || stream->peek() == std::istream::traits_type::eof() ) {
+          finished = true;
+          return;
+        }
+        uint32_t delta = 0u;
+        for( size_t i = 0u; ; ++i ) {
+          if( i == 4u ) throw invalid_variable_length_quantity();
+          const auto c = get();
+          delta = ( delta << 7 ) | ( c & 0x7Fu );
+          if( !( c & 0x80u ) ) break;
+        }
+        tick += delta;
+        message.clear();
+        auto head = get();
+        if( head & 0x80u ) {
+          current_status_byte = head;
+        }
+        else {
+          if( !current_status_byte ) throw invalid_midi_message();
+          message.push_back( head );
+        }
+        read_message();
+        if( current_status_byte == 0xFF && !message.empty() ) {
+          if( message[ 0 ] == 0x2F ) {
+            finished = true;
+            return;
+          }
+          if( message[ 0 ] == 0x51 ) {
+            if( message.size() != 5u || message[ 1 ] != 0x03 ) throw invalid_midi_message();
+            tempo.push( tick, ( ( uint32_t( message[ 2 ] ) << 16 ) | ( uint32_t( message[ 3 ] ) << 8 ) | message[ 4 ] ) * 1000ull );
+            continue;
+          }
+        }
+        status = current_status_byte;
+        time = ( tempo.get_time( tick ) + step.count() - 1u ) / step.count();
+        pending = true;
+        return;
+      }
+    }
+    // get_smf_message_endと同じ規則でメッセージの残りを読む
+    void read_message() {
+      const auto fixed = [&]( size_t len ) {
+        while( message.size() < len ) message.push_back( get() );
+      };
+      if( ( current_status_byte & 0xF0 ) == 0xC0 || ( current_status_byte & 0xF0 ) == 0xD0 ) fixed( 1u );
+      else if( current_status_byte < 0xF0 ) fixed( 2u );
+      else if( current_status_byte == 0xF0 ) {
+        do message.push_back( get() ); while( message.back() != 0xF7 );
+      }
+      else if( current_status_byte == 0xF1 ) fixed( 1u );
+      else if( current_status_byte == 0xF2 ) fixed( 2u );
+      else if( current_status_byte == 0xF3 ) fixed( 1u );
+      else if(
+        current_status_byte == 0xF6 || current_status_byte == 0xF8 || current_status_byte == 0xFA ||
+        current_status_byte == 0xFB || current_status_byte == 0xFC || current_status_byte == 0xFE
+      ) fixed( 0u );
+      else if( current_status_byte == 0xFF ) {
+        fixed( 2u );
+        fixed( message[ 1 ] + 2u );
+      }
+      else throw invalid_midi_message();
+    }
+    std::istream *stream;
+    std::chrono::nanoseconds step;
+    // トラックの残りのバイト数
+    uint32_t left;
+    uint64_t tick;
+    tempo_map_t tempo;
+    uint64_t position;
+    uint64_t overrun;
+    uint8_t current_status_byte;
+    // 先読みした次のイベント
+    bool pending;
+    bool finished;
+    uint64_t time;
+    uint8_t status;
+    std::vector< uint8_t > message;
+  };
+}
+
+#endif
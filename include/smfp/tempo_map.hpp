@@ -0,0 +1,60 @@
+#ifndef SMFP_TEMPO_MAP_HPP
+#define SMFP_TEMPO_MAP_HPP
+
+#include <cstdint>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+#include <smfp/header.hpp>
+#include <smfp/exceptions.hpp>
+
+namespace smfp {
+  // tickと先頭からの時刻(ns)を相互に変換する
+  // テンポが変わる位置毎に区間を持ち、区間内は整数演算で変換するので誤差が溜まらない
+  class tempo_map_t {
+  public:
+    tempo_map_t( const smf_header_t &header ) :
+      qnres( header.qnres ), time_unit( header.time_unit.count() ) {
+      segments.push_back( segment_t{ 0u, 0u, 60ull * 1000ull * 1000ull * 1000ull / 120u } );
+    }
+    // tick以降のテンポを4分音符あたりnspbナノ秒にする
+    // tickは前回以上でなければならない
+    void push( uint64_t tick, uint64_t nspb ) {
+      if( !qnres ) return;
+      if( nspb == 0u ) throw invalid_midi_message();
+      if( segments.back().tick == tick ) {
+        segments.back().nspb = nspb;
+        return;
+      }
+      segments.push_back( segment_t{ tick, get_time( tick ), nspb } );
+    }
+    uint64_t get_time( uint64_t tick ) const {
+      if( !qnres ) return tick * time_unit;
+      const auto &s = *std::prev( std::upper_bound( segments.begin(), segments.end(), tick, []( uint64_t t, const segment_t &s ) { return t < s.tick; } ) );
+      return s.time + ( tick - s.tick ) * s.nspb / qnres;
+    }
+    // 時刻timeまでに始まっている最後のtick
+    uint64_t get_tick( uint64_t time ) const {
+      if( !qnres ) return time / time_unit;
+      const auto &s = *std::prev( std::upper_bound( segments.begin(), segments.end(), time, []( uint64_t t, const segment_t &s ) { return t < s.time; } ) );
+      const auto elapsed = time - s.time;
+      auto tick = elapsed * qnres / s.nspb;
+      while( ( tick + 1u ) * s.nspb / qnres <= elapsed ) ++tick;
+      return s.tick + tick;
+    }
+    size_t size() const {
+      return segments.size();
+    }
+  private:
+    struct segment_t {
+      uint64_t tick;
+      uint64_t time;
+      uint64_t nspb;
+    };
+    uint32_t qnres;
+    uint64_t time_unit;
+    std::vector< segment_t > segments;
+  };
+}
+
+#endif
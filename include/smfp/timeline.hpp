@@ -0,0 +1,205 @@
+#ifndef SMFP_TIMELINE_HPP
+#define SMFP_TIMELINE_HPP
+
+#include <cstdint>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <exception>
+#include <iterator>
+#include <numeric>
+#include <queue>
+#include <tuple>
+#include <functional>
+#include <utility>
+#include <vector>
+#include <smfp/header.hpp>
+#include <smfp/exceptions.hpp>
+#include <smfp/decode_integer.hpp>
+#include <smfp/decode_variable_length_quantity.hpp>
+#include <smfp/track.hpp>
+#include <smfp/tempo_map.hpp>
+
+namespace smfp {
+  // 全トラックを事前にデコードして時刻順に並べたイベント列
+  // テンポはデコード時に解決し、時刻はサンプル単位で持つ
+  class smf_timeline_t {
+  public:
+    template< typename Iterator, typename Sentinel >
+    smf_timeline_t(
+      const smf_header_t &header,
+      Iterator begin,
+      Sentinel end,
+      std::chrono::nanoseconds step_
+    ) : step( step_ ), tempo( header ) {
+      std::vector< std::pair< Iterator, Iterator > > tracks;
+      auto cur = begin;
+      for( unsigned int i = 0; i != header.ntrks && cur != end; ++i ) {
+        if( std::distance( cur, end ) < 8 ) throw invalid_smf_track();
+        constexpr std::array< unsigned char, 4u > magic{ 'M', 'T', 'r', 'k' };
+        if( !std::equal( magic.begin(), magic.end(), cur ) ) throw invalid_smf_track();
+        cur = std::next( cur, 4 );
+        auto [data,length] = decode_integer< uint32_t >( cur, end );
+        cur = data;
+        if( std::distance( cur, end ) < length ) throw invalid_smf_track();
+        auto next = std::next( cur, length );
+        tracks.emplace_back( cur, next );
+        cur = next;
+      }
+      std::vector< std::vector< record_t< Iterator > > > decoded( tracks.size() );
+      std::vector< std::exception_ptr > errors( tracks.size() );
+#pragma omp parallel for schedule( dynamic )
+      for( size_t i = 0; i < tracks.size(); ++i ) {
+        try {
+          decoded[ i ] = decode_track( tracks[ i ].first, tracks[ i ].second );
+        }
+        catch( ... ) {
+          errors[ i ] = std::current_exception();
+        }
+      }
+      for( const auto &e: errors )
+        if( e ) std::rethrow_exception( e );
+      // smf_tracks_tと同じく、同じtickのイベントは先にキューに入ったトラックから取り出す
+      std::vector< record_t< Iterator > > merged;
+      merged.reserve( std::accumulate( decoded.begin(), decoded.end(), size_t( 0 ), []( size_t sum, const auto &v ) { return sum + v.size(); } ) );
+      using queue_entry_t = std::tuple< uint64_t, uint64_t, size_t >;
+      std::priority_queue< queue_entry_t, std::vector< queue_entry_t >, std::greater< queue_entry_t > > queue;
+      std::vector< size_t > heads( decoded.size(), 0u );
+      uint64_t order = 0u;
+      for( size_t i = 0u; i != decoded.size(); ++i )
+        if( !decoded[ i ].empty() ) queue.emplace( decoded[ i ].front().tick, order++, i );
+      while( !queue.empty() ) {
+        const auto track = std::get< 2 >( queue.top() );
+        queue.pop();
+        merged.push_back( decoded[ track ][ heads[ track ]++ ] );
+        if( heads[ track ] != decoded[ track ].size() )
+          queue.emplace( decoded[ track ][ heads[ track ] ].tick, order++, track );
+      }
+      compile( merged );
+    }
+    std::chrono::nanoseconds get_step() const {
+      return step;
+    }
+    const tempo_map_t &get_tempo_map() const {
+      return tempo;
+    }
+    size_t size() const {
+      return time.size();
+    }
+    bool empty() const {
+      return time.empty();
+    }
+    template< typename Handler >
+    void dispatch( size_t i, Handler &handler ) const {
+      const uint8_t *head = ( length[ i ] <= data[ i ].size() ) ? data[ i ].data() : std::next( extra.data(), offset[ i ] );
+      handler( status[ i ], head, std::next( head, length[ i ] ) );
+    }
+    std::vector< uint64_t > time;
+    std::vector< uint8_t > status;
+    std::vector< std::array< uint8_t, 2u > > data;
+    std::vector< uint32_t > length;
+    // dataに収まらないメッセージのextra内の位置
+    std::vector< uint32_t > offset;
+    std::vector< uint8_t > extra;
+  private:
+    template< typename Iterator >
+    struct record_t {
+      uint64_t tick;
+      uint8_t status;
+      Iterator begin;
+      Iterator end;
+    };
+    template< typename Iterator >
+    static std::vector< record_t< Iterator > > decode_track( Iterator cur, Iterator end ) {
+      std::vector< record_t< Iterator > > records;
+      uint64_t tick = 0u;
+      uint8_t current_status_byte = 0u;
+      while( cur != end ) {
+        const auto [message_head,left] = decode_variable_length_quantity( cur, end );
+        cur = message_head;
+        tick += left;
+        if( cur == end ) break;
+        if( ( uint8_t( *cur ) & 0x80 ) != 0x00 ) {
+          current_status_byte = *cur;
+          cur = std::next( cur );
+        }
+        const auto message_end = get_smf_message_end( current_status_byte, cur, end );
+        records.push_back( record_t< Iterator >{ tick, current_status_byte, cur, message_end } );
+        cur = message_end;
+      }
+      return records;
+    }
+    template< typename Iterator >
+    void compile( const std::vector< record_t< Iterator > > &records ) {
+      for( const auto &r: records ) {
+        if( r.status == 0xFF && r.begin != r.end && *r.begin == 0x51 ) {
+          const auto length_ = std::distance( r.begin, r.end );
+          if( length_ != 5 || *std::next( r.begin ) != 0x03 ) throw invalid_midi_message();
+          auto cur = std::next( r.begin, 2 );
+          uint32_t new_uspb = uint8_t( *cur );
+          ++cur;
+          new_uspb <<= 8;
+          new_uspb |= uint8_t( *cur );
+          ++cur;
+          new_uspb <<= 8;
+          new_uspb |= uint8_t( *cur );
+          tempo.push( r.tick, new_uspb * 1000ull );
+          continue;
+        }
+        const uint64_t ns = tempo.get_time( r.tick );
+        time.push_back( ( ns + step.count() - 1u ) / step.count() );
+        status.push_back( r.status );
+        const uint32_t length_ = std::distance( r.begin, r.end );
+        length.push_back( length_ );
+        std::array< uint8_t, 2u > inline_data{ 0u, 0u };
+        if( length_ <= inline_data.size() ) {
+          std::copy( r.begin, r.end, inline_data.begin() );
+          offset.push_back( 0u );
+        }
+        else {
+          offset.push_back( extra.size() );
+          extra.insert( extra.end(), r.begin, r.end );
+        }
+        data.push_back( inline_data );
+      }
+    }
+    std::chrono::nanoseconds step;
+    tempo_map_t tempo;
+  };
+  // smf_timeline_tを先頭から順に再生する
+  // smf_tracks_tと同じインターフェースを持つ
+  class smf_timeline_player_t {
+  public:
+    smf_timeline_player_t( const smf_timeline_t &timeline_ ) :
+      timeline( &timeline_ ), cursor( 0u ), position( 0u ), overrun( 0u ) {}
+    template< typename Handler >
+    void operator()( std::chrono::nanoseconds adv, Handler &handler ) {
+      const uint64_t total = adv.count() + overrun;
+      const uint64_t step = timeline->get_step().count();
+      position += total / step;
+      overrun = total % step;
+      while( cursor != timeline->size() && timeline->time[ cursor ] <= position ) {
+        timeline->dispatch( cursor, handler );
+        ++cursor;
+      }
+    }
+    std::chrono::nanoseconds get_distance() const {
+      if( end() ) return std::chrono::nanoseconds( 0 );
+      const uint64_t step = timeline->get_step().count();
+      const uint64_t next = timeline->time[ cursor ] * step;
+      const uint64_t now = position * step + overrun;
+      return std::chrono::nanoseconds( next > now ? next - now : 0u );
+    }
+    bool end() const {
+      return cursor == timeline->size();
+    }
+  private:
+    const smf_timeline_t *timeline;
+    size_t cursor;
+    uint64_t position;
+    uint64_t overrun;
+  };
+}
+
+#endif
+
@@ -2,11 +2,16 @@
 #define SMFP_TRACK_HPP
 
 #include <cstdint>
+#include <algorithm>
+#include <iterator>
 #include <vector>
 #include <array>
 #include <tuple>
+#include <queue>
+#include <functional>
 #include <stamp/setter.hpp>
 #include <smfp/header.hpp>
+#include <smfp/tempo_map.hpp>
 #include <smfp/exceptions.hpp>
 #include <smfp/decode_variable_length_quantity.hpp>
 
@@ -15,7 +20,7 @@ namespace smfp {
   using track_id_t = uint32_t;
   template< typename Iterator, typename Sentinel >
   struct smf_track_t {
-    smf_track_t() : id( 0 ), begin( Iterator() ), cur( Iterator() ), end( Sentinel() ), left( 0 ), next( nullptr ), current_status_byte( 0 ) {}
+    smf_track_t() : id( 0 ), begin( Iterator() ), cur( Iterator() ), end( Sentinel() ), time( 0 ), current_status_byte( 0 ) {}
     LIBSTAMP_SETTER( id )
     LIBSTAMP_SETTER( begin )
     LIBSTAMP_SETTER( end )
@@ -24,10 +29,48 @@ namespace smfp {
     Iterator begin;
     Iterator cur;
     Sentinel end;
-    step_t left;
-    smf_track_t *next;
+    // 次のイベントの先頭からのtick
+    uint64_t time;
     uint8_t current_status_byte;
   };
+  // ステータスバイトの後に続くメッセージの終端を返す
+  template< typename Iterator, typename Sentinel >
+  Iterator get_smf_message_end( uint8_t message_head, Iterator cur, Sentinel end ) {
+    if( cur == end ) return cur;
+    std::size_t len = 0u;
+    if( ( message_head & 0xF0 ) == 0x80 ) len = 2;
+    else if( ( message_head & 0xF0 ) == 0x90 ) len = 2;
+    else if( ( message_head & 0xF0 ) == 0xA0 ) len = 2;
+    else if( ( message_head & 0xF0 ) == 0xB0 ) len = 2;
+    else if( ( message_head & 0xF0 ) == 0xC0 ) len = 1;
+    else if( ( message_head & 0xF0 ) == 0xD0 ) len = 1;
+    else if( ( message_head & 0xF0 ) == 0xE0 ) len = 2;
+    else if( message_head == 0xF0 )
+      len = std::distance( cur, std::find( cur, end, 0xF7 ) ) + 1;
+    else if( message_head == 0xF1 ) len = 1;
+    else if( message_head == 0xF2 ) len = 2;
+    else if( message_head == 0xF3 ) len = 1;
+    else if( message_head == 0xF6 ) len = 0;
+    else if( message_head == 0xF8 ) len = 0;
+    else if( message_head == 0xFA ) len = 0;
+    else if( message_head == 0xFB ) len = 0;
+    else if( message_head == 0xFC ) len = 0;
+    else if( message_head == 0xFE ) len = 0; 
+    else if( message_head == 0xFF ) {
+      if( std::distance( cur, end ) < 2 ) {
+        throw invalid_midi_message();
+      }
+      auto length = *std::next( cur );
+      len = length + 2;
+    }
+    else {
+      throw invalid_midi_message();
+    }
+    if( std::distance( cur, end ) < int( len ) ) {
+      throw invalid_midi_message();
+    }
+    return std::next( cur, len );
+  }
   template< typename Iterator, typename Sentinel >
   class smf_tracks_t {
   public:
@@ -36,9 +79,8 @@ namespace smfp {
       const smf_header_t &header_,
       Iterator begin,
       Sentinel end
-    ) : header( header_ ), gbegin( begin ), head( nullptr ), overrun( 0 ), nspb( 60ull * 1000ull * 1000ull * 1000ull / 120u ) {
+    ) : header( header_ ), gbegin( begin ), elapsed( 0 ), order( 0 ), tempo( header_ ) {
       auto cur = begin;
-      auto track_count = 0u;
       for( unsigned int i = 0; i != header.ntrks &&  cur != end; ++i ) {
         if( std::distance( cur, end ) < 8 ) throw invalid_smf_track();
         constexpr std::array< unsigned char, 4u > magic{ 'M', 'T', 'r', 'k' };
@@ -48,15 +90,15 @@ namespace smfp {
         cur = data;
         if( std::distance( cur, end ) < length ) throw invalid_smf_track();
         auto next = std::next( cur, length );
-        tracks[ track_count ] =
+        tracks.push_back(
           track_t()
-            .set_id( track_count )
+            .set_id( tracks.size() )
             .set_begin( cur )
             .set_end( next )
-            .set_cur( cur );
-        parse_time( tracks.data() + track_count );
+            .set_cur( cur )
+        );
+        parse_time( &tracks.back() );
         cur = next;
-        ++track_count;
       }
       for( auto &v: tracks ) {
         insert( &v );
@@ -64,73 +106,42 @@ namespace smfp {
     }
     template< typename Handler >
     void operator()( std::chrono::nanoseconds adv, Handler &handler ) {
-      step_t step;
-      if( header.qnres ) {
-        step = ( uint64_t( adv.count() + overrun ) * header.qnres ) / nspb;
-        overrun = std::max( int64_t( adv.count() - ( step * nspb / header.qnres - overrun ) ), int64_t( 0 ) );
-      }
-      else {
-        step = ( uint64_t( adv.count() ) + overrun ) / header.time_unit.count();
-        overrun = std::max( int64_t( adv.count() - ( step * header.time_unit.count() - overrun ) ), int64_t( 0 ) );
-      }
-      while( 1 ) {
-        if( head ) {
-          if( head->left <= step ) {
-            update_current_status_byte( head );
-            if( head->current_status_byte == 0xFF ) {
-              auto cur = head->cur;
-              const auto type = *cur;
-              if( type == 0x51 ) {
-                set_tempo( std::next( cur ), get_message_end( head ) );
-              }
-              else {
-                auto end = get_message_end( head );
-                handler( head->current_status_byte, head->cur, end );
-              }
-            }
-            else {
-              auto end = get_message_end( head );
-              handler( head->current_status_byte, head->cur, end );
-            }
-            auto old_head = pop();
-            sub_left( old_head->left );
-            step -= old_head->left;
-            old_head->left = 0;
-            next( old_head );
-            insert( old_head );
+      elapsed += adv.count();
+      // テンポが変わると到達したtickも変わるので、イベント毎に求め直す
+      while( !queue.empty() ) {
+        auto head = &tracks[ std::get< 2 >( queue.top() ) ];
+        if( head->time > tempo.get_tick( elapsed ) ) break;
+        queue.pop();
+        update_current_status_byte( head );
+        if( head->current_status_byte == 0xFF ) {
+          auto cur = head->cur;
+          const auto type = *cur;
+          if( type == 0x51 ) {
+            set_tempo( head->time, std::next( cur ), get_message_end( head ) );
           }
           else {
-            sub_left( step );
-            break;
+            auto end = get_message_end( head );
+            handler( head->current_status_byte, head->cur, end );
           }
         }
-        else break;
+        else {
+          auto end = get_message_end( head );
+          handler( head->current_status_byte, head->cur, end );
+        }
+        next( head );
+        insert( head );
       }
     }
     std::chrono::nanoseconds get_distance() const {
-      if( !head ) return std::chrono::nanoseconds( 0 );
-      if( header.qnres )
-        return std::chrono::nanoseconds( std::max( ( uint64_t( head->left ) * nspb ) / header.qnres - overrun, uint64_t( nspb / header.qnres ) ) );
-      else
-        return std::chrono::nanoseconds( std::max( head->left * header.time_unit.count() - overrun, uint64_t( nspb / header.qnres ) ) );
+      if( queue.empty() ) return std::chrono::nanoseconds( 0 );
+      const uint64_t next = tempo.get_time( std::get< 0 >( queue.top() ) );
+      return std::chrono::nanoseconds( next > elapsed ? next - elapsed : 0u );
     }
     bool end() const {
-      return !head;
+      return queue.empty();
     }
   private:
-    track_t *pop() {
-      auto old_head = head;
-      head = head->next;
-      return old_head;
-    }
-    void sub_left( step_t step ) {
-      auto cur = head;
-      while( cur ) {
-        cur->left -= step;
-        cur = cur->next;
-      }
-    }
-    void set_tempo( Iterator begin, Iterator /*end*/ ) {
+    void set_tempo( uint64_t tick, Iterator begin, Iterator /*end*/ ) {
       auto cur = begin;
       const auto length = *cur;
       if( length != 0x03 ) {
@@ -144,7 +155,7 @@ namespace smfp {
       ++cur;
       new_uspb <<= 8;
       new_uspb |= *cur;
-      nspb = new_uspb * 1000ull;
+      tempo.push( tick, new_uspb * 1000ull );
     }
     void update_current_status_byte( track_t *track ) {
       const uint8_t message_head = *track->cur;
@@ -153,41 +164,7 @@ namespace smfp {
       track->cur = std::next( track->cur );
     }
     Iterator get_message_end( const track_t *track ) {
-      if( track->cur == track->end ) return track->cur;
-      const uint8_t message_head = track->current_status_byte;
-      std::size_t len = 0u;
-      if( ( message_head & 0xF0 ) == 0x80 ) len = 2;
-      else if( ( message_head & 0xF0 ) == 0x90 ) len = 2;
-      else if( ( message_head & 0xF0 ) == 0xA0 ) len = 2;
-      else if( ( message_head & 0xF0 ) == 0xB0 ) len = 2;
-      else if( ( message_head & 0xF0 ) == 0xC0 ) len = 1;
-      else if( ( message_head & 0xF0 ) == 0xD0 ) len = 1;
-      else if( ( message_head & 0xF0 ) == 0xE0 ) len = 2;
-      else if( message_head == 0xF0 )
-        len = std::distance( track->cur, std::find( track->cur, track->end, 0xF7 ) );
-      else if( message_head == 0xF1 ) len = 1;
-      else if( message_head == 0xF2 ) len = 2;
-      else if( message_head == 0xF3 ) len = 1;
-      else if( message_head == 0xF6 ) len = 0;
-      else if( message_head == 0xF8 ) len = 0;
-      else if( message_head == 0xFA ) len = 0;
-      else if( message_head == 0xFB ) len = 0;
-      else if( message_head == 0xFC ) len = 0;
-      else if( message_head == 0xFE ) len = 0; 
-      else if( message_head == 0xFF ) {
-        if( std::distance( track->cur, track->end ) < 2 ) {
-          throw invalid_midi_message();
-        }
-        auto length = *std::next( track->cur );
-        len = length + 2;
-      }
-      else {
-        throw invalid_midi_message();
-      }
-      if( std::distance( track->cur, track->end ) < int( len ) ) {
-        throw invalid_midi_message();
-      }
-      return std::next( track->cur, len );
+      return get_smf_message_end( track->current_status_byte, track->cur, track->end );
     }
     void consume_message( track_t *track ) {
       track->cur = get_message_end( track );
@@ -196,47 +173,26 @@ namespace smfp {
       if( track->cur == track->end ) return;
       const auto &[message_head,left] = decode_variable_length_quantity( track->cur, track->end );
       track->cur = message_head;
-      track->left = left;
+      track->time += left;
     }
     void next( track_t *track ) {
-      if( track->left != 0 ) throw invalid_midi_operation();
       consume_message( track );
       parse_time( track );
     }
+    // 同じtickのトラックは先に入ったものから取り出す
     void insert( track_t *track ) {
       if( track->cur == track->end ) return;
-      if( !head ) {
-        head = track;
-        return;
-      }
-      else if( head->left > track->left ) {
-        track->next = head;
-        head = track;
-        return;
-      }
-      else {
-        auto prev = head;
-        auto cur = head->next;
-        while( cur ) {
-          if( cur->left > track->left ) {
-            prev->next = track;
-            track->next = cur;
-            return;
-          }
-          prev = cur;
-          cur = cur->next;
-        }
-        prev->next = track;
-        track->next = nullptr;
-      }
+      queue.emplace( track->time, order++, track->id );
     }
+    using queue_entry_t = std::tuple< uint64_t, uint64_t, track_id_t >;
     smf_header_t header;
     Iterator gbegin;
-    track_t *head;
-    uint64_t overrun;
-    std::vector< std::tuple< step_t, Iterator, Iterator > > events;
-    std::array< track_t, 32u > tracks;
-    uint64_t nspb;
+    // 先頭からの経過時間(ns)
+    uint64_t elapsed;
+    uint64_t order;
+    std::vector< track_t > tracks;
+    std::priority_queue< queue_entry_t, std::vector< queue_entry_t >, std::greater< queue_entry_t > > queue;
+    tempo_map_t tempo;
   };
 }
 
@@ -16,6 +16,8 @@ namespace smfp {
     variable_config_t( const nlohmann::json &config ) {
       if( !config.is_object() ) throw invalid_instrument_config( "variable_config_t: rootがobjectでない" );
       for( const auto &[key_str,value]: config.items() ) {
+        // typeはvariant_instrument_config_tが楽器の種類を選ぶのに使う
+        if( key_str == "type" ) continue;
         auto iter = key_str.begin();
         uint32_t key = 0;
         if( !boost::spirit::qi::parse( iter, key_str.end(), boost::spirit::qi::uint_, key ) )
@@ -51,6 +53,10 @@ namespace smfp {
   class variable_t {
   public:
     using config_type = variable_config_t< typename T::config_type >;
+    static std::string get_type_name() {
+      return T::get_type_name();
+    }
+    static constexpr bool has_partials = T::has_partials;
     variable_t( const std::shared_ptr< config_type > &config_ ) :
       config( config_ ), backend( config_->get( 0 ) ), current_note( 0 ) {}
     nlohmann::json dump() const {
@@ -84,6 +90,21 @@ namespace smfp {
     void operator()( std::chrono::nanoseconds step, Iterator begin, Iterator end ) {
       return backend( step, begin, end );
     }
+    std::tuple< float, float > advance( std::chrono::nanoseconds step ) {
+      return backend.advance( step );
+    }
+    std::tuple< float, float > advance( std::chrono::nanoseconds step, uint64_t count ) {
+      return backend.advance( step, count );
+    }
+    std::tuple< float, float > trace( std::chrono::nanoseconds step ) {
+      return backend.trace( step );
+    }
+    std::tuple< float, float > skip( std::chrono::nanoseconds step, uint64_t count ) {
+      return backend.skip( step, count );
+    }
+    auto get_partials() const {
+      return backend.get_partials();
+    }
     void set_variable( channel_variable_id_t id, note_t at, const channel_state_t &cst ) {
       backend.set_variable( id, at, cst );
     }
@@ -0,0 +1,179 @@
+#ifndef SMFP_VARIANT_INSTRUMENT_HPP
+#define SMFP_VARIANT_INSTRUMENT_HPP
+
+#include <array>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <variant>
+#include <nlohmann/json.hpp>
+#include <smfp/channel_state.hpp>
+#include <smfp/active_note.hpp>
+#include <smfp/exceptions.hpp>
+#include <smfp/2op.hpp>
+
+namespace smfp {
+  // typeで楽器の種類を選ぶ設定
+  // typeが無い場合は最初の種類として扱う
+  template< typename ...T >
+  struct variant_instrument_config_t {
+    variant_instrument_config_t() {}
+    variant_instrument_config_t( const nlohmann::json &config ) {
+      if( !config.is_object() ) throw invalid_instrument_config( "variant_instrument_config_t: rootがobjectでない" );
+      const auto type = config.find( "type" );
+      if( type == config.end() ) {
+        value.template emplace< 0u >( config );
+        return;
+      }
+      if( !type->is_string() ) throw invalid_instrument_config( "variant_instrument_config_t: typeが文字列でない" );
+      load< 0u >( std::string( *type ), config );
+    }
+    nlohmann::json dump() const {
+      auto root = std::visit( []( const auto &v ) { return v.dump(); }, value );
+      root[ "type" ] = get_type_name< 0u >();
+      return root;
+    }
+    // 選ばれた楽器を加算合成で鳴らせるか
+    bool has_partials() const {
+      static constexpr std::array< bool, sizeof...( T ) > table{ T::has_partials... };
+      return table[ value.index() ];
+    }
+    std::variant< typename T::config_type... > value;
+  private:
+    template< size_t i >
+    void load( const std::string &name, const nlohmann::json &config ) {
+      if constexpr ( i == sizeof...( T ) )
+        throw invalid_instrument_config( "variant_instrument_config_t: typeで指定された楽器が存在しない" );
+      else if( std::tuple_element_t< i, std::tuple< T... > >::get_type_name() == name )
+        value.template emplace< i >( config );
+      else
+        load< i + 1u >( name, config );
+    }
+    template< size_t i >
+    std::string get_type_name() const {
+      if constexpr ( i == sizeof...( T ) )
+        return std::string();
+      else if( value.index() == i )
+        return std::tuple_element_t< i, std::tuple< T... > >::get_type_name();
+      else
+        return get_type_name< i + 1u >();
+    }
+  };
+  // 楽器の種類をstd::variantで持ち、仮想関数を使わずに呼び分ける
+  // std::variantなので、どの種類を選んでもボイスの大きさは最も大きい種類と同じになる
+  template< typename ...T >
+  class variant_instrument_t {
+  public:
+    using config_type = variant_instrument_config_t< T... >;
+    variant_instrument_t( const std::shared_ptr< config_type > &config ) :
+      backend( create< 0u >( config ) ) {}
+    nlohmann::json dump() const {
+      return std::visit( []( const auto &v ) { return v.dump(); }, backend );
+    }
+    void set_config( const channel_state_t &cst, const std::shared_ptr< config_type > &config ) {
+      if( backend.index() != config->value.index() ) {
+        std::visit( [&]( auto &v ) { v.clear( cst ); }, backend );
+        backend = create< 0u >( config );
+      }
+      else set_config< 0u >( cst, config );
+    }
+    void note_on( const channel_state_t &cst, const active_note_t &nst ) {
+      std::visit( [&]( auto &v ) { v.note_on( cst, nst ); }, backend );
+    }
+    void note_off( const channel_state_t &cst ) {
+      std::visit( [&]( auto &v ) { v.note_off( cst ); }, backend );
+    }
+    void clear( const channel_state_t &cst ) {
+      std::visit( [&]( auto &v ) { v.clear( cst ); }, backend );
+    }
+    void set_frequency( const channel_state_t &cst, float freq ) {
+      std::visit( [&]( auto &v ) { v.set_frequency( cst, freq ); }, backend );
+    }
+    std::tuple< float, float > operator()( std::chrono::nanoseconds step ) {
+      return std::visit( [&]( auto &v ) { return v( step ); }, backend );
+    }
+    // 呼び分けはブロック単位で行い、内側のループは各楽器の実装に任せる
+    template< typename Iterator >
+    void operator()( std::chrono::nanoseconds step, Iterator begin, Iterator end ) {
+      std::visit( [&]( auto &v ) { v( step, begin, end ); }, backend );
+    }
+    // countサンプル分の値をvalに、エンベロープを線形にした値をenvに足す
+    void mix( std::chrono::nanoseconds step, float *val, float *env, size_t count ) {
+      std::visit( [&]( auto &v ) {
+        for( size_t i = 0u; i != count; ++i ) {
+          const auto [e,value] = v( step );
+          val[ i ] += value;
+          if( e != -std::numeric_limits< float >::infinity() )
+            env[ i ] += std::pow( 10.f, e / 40.f );
+        }
+      }, backend );
+    }
+    // 描画した場合と同じ状態になるようにcountサンプル進め、エンベロープを線形にした値をenvに足す
+    void trace( std::chrono::nanoseconds step, float *env, size_t count ) {
+      std::visit( [&]( auto &v ) {
+        for( size_t i = 0u; i != count; ++i )
+          env[ i ] += std::get< 1 >( v.trace( step ) );
+      }, backend );
+    }
+    std::tuple< float, float > advance( std::chrono::nanoseconds step ) {
+      return std::visit( [&]( auto &v ) { return v.advance( step ); }, backend );
+    }
+    std::tuple< float, float > advance( std::chrono::nanoseconds step, uint64_t count ) {
+      return std::visit( [&]( auto &v ) { return v.advance( step, count ); }, backend );
+    }
+    std::tuple< float, float > skip( std::chrono::nanoseconds step, uint64_t count ) {
+      return std::visit( [&]( auto &v ) { return v.skip( step, count ); }, backend );
+    }
+    fm_2op_nofb_partials_t get_partials() const {
+      return std::visit( []( const auto &v ) -> fm_2op_nofb_partials_t { return v.get_partials(); }, backend );
+    }
+    void set_variable( channel_variable_id_t id, note_t at, const channel_state_t &cst ) {
+      std::visit( [&]( auto &v ) { v.set_variable( id, at, cst ); }, backend );
+    }
+    void set_program( const channel_state_t &cst, uint8_t prog ) {
+      std::visit( [&]( auto &v ) { v.set_program( cst, prog ); }, backend );
+    }
+    void set_volume( const channel_state_t &cst, float value ) {
+      std::visit( [&]( auto &v ) { v.set_volume( cst, value ); }, backend );
+    }
+    template< typename Iterator >
+    void system_exclusive( const channel_state_t &cst, Iterator begin, Iterator end ) {
+      std::visit( [&]( auto &v ) { v.system_exclusive( cst, begin, end ); }, backend );
+    }
+    bool is_end() const {
+      return std::visit( []( const auto &v ) { return v.is_end(); }, backend );
+    }
+  private:
+    template< size_t i >
+    using element_type = std::tuple_element_t< i, std::tuple< T... > >;
+    // 設定の中の選ばれた種類の部分を、設定全体と寿命を共有するポインタで渡す
+    template< size_t i >
+    static std::shared_ptr< typename element_type< i >::config_type > get_config( const std::shared_ptr< config_type > &config ) {
+      return std::shared_ptr< typename element_type< i >::config_type >( config, &std::get< i >( config->value ) );
+    }
+    template< size_t i >
+    static std::variant< T... > create( const std::shared_ptr< config_type > &config ) {
+      if constexpr ( i + 1u == sizeof...( T ) )
+        return std::variant< T... >( std::in_place_index< i >, get_config< i >( config ) );
+      else if( config->value.index() == i )
+        return std::variant< T... >( std::in_place_index< i >, get_config< i >( config ) );
+      else
+        return create< i + 1u >( config );
+    }
+    template< size_t i >
+    void set_config( const channel_state_t &cst, const std::shared_ptr< config_type > &config ) {
+      if constexpr ( i + 1u == sizeof...( T ) )
+        std::get< i >( backend ).set_config( cst, get_config< i >( config ) );
+      else if( backend.index() == i )
+        std::get< i >( backend ).set_config( cst, get_config< i >( config ) );
+      else
+        set_config< i + 1u >( cst, config );
+    }
+    std::variant< T... > backend;
+  };
+}
+
+#endif
+
@@ -0,0 +1,150 @@
+#ifndef SMFP_VOICE_ALLOCATOR_HPP
+#define SMFP_VOICE_ALLOCATOR_HPP
+
+#include <cstdint>
+#include <array>
+#include <bit>
+#include <limits>
+#include <vector>
+#include <smfp/types.hpp>
+#include <smfp/active_note.hpp>
+#include <smfp/exceptions.hpp>
+
+namespace smfp {
+  enum class voice_state_t : uint8_t {
+    note_on,
+    delayed_note_off,
+    note_off,
+    free
+  };
+  // スロットの割り当てを固定長の表で管理する
+  // (チャンネル,ノート)からスロットを直接引く表と、状態ごとに状態に入った順に並べた双方向リスト、空きスロットのビットマップを持つ
+  // チャンネルごとにも使用中のスロットを双方向リストで繋ぎ、コントローラの変更はそのチャンネルのスロットだけを辿る
+  // どの操作もメモリを確保せず定数時間で終わる
+  class voice_allocator_t {
+  public:
+    constexpr static slot_t none = std::numeric_limits< slot_t >::max();
+    voice_allocator_t( size_t slot_count ) :
+      voices( slot_count ),
+      available( ( slot_count + 63u ) / 64u, 0u ) {
+      if( slot_count > none ) throw invalid_midi_operation();
+      for( size_t i = 0u; i != slot_count; ++i )
+        available[ i / 64u ] |= uint64_t( 1u ) << ( i % 64u );
+      by_note.fill( none );
+      for( auto &l: lists ) l = list_t{ none, none };
+      for( auto &l: channels ) l = list_t{ none, none };
+    }
+    slot_t find( uint16_t channel_note ) const {
+      return by_note[ get_index( channel_note ) ];
+    }
+    const active_note_t &get( slot_t slot ) const {
+      return voices[ slot ].note;
+    }
+    voice_state_t get_state( slot_t slot ) const {
+      return voices[ slot ].state;
+    }
+    // 使われたことのない空きスロットを番号の大きい順に返す
+    slot_t allocate() {
+      for( size_t i = available.size(); i != 0u; --i ) {
+        auto &word = available[ i - 1u ];
+        if( word ) {
+          const auto bit = 63u - std::countl_zero( word );
+          word &= ~( uint64_t( 1u ) << bit );
+          return slot_t( ( i - 1u ) * 64u + bit );
+        }
+      }
+      return none;
+    }
+    // 指定した状態に最も長くいるスロット
+    slot_t oldest( voice_state_t state ) const {
+      return lists[ int( state ) ].head;
+    }
+    void insert( const active_note_t &note, voice_state_t state ) {
+      auto &v = voices[ note.slot ];
+      v.note = note;
+      by_note[ get_index( note.channel_note ) ] = note.slot;
+      link( note.slot, state );
+      auto &l = channels[ get_channel( note.channel_note ) ];
+      v.channel_prev = l.tail;
+      v.channel_next = none;
+      if( l.tail != none ) voices[ l.tail ].channel_next = note.slot;
+      else l.head = note.slot;
+      l.tail = note.slot;
+    }
+    void erase( slot_t slot ) {
+      auto &v = voices[ slot ];
+      unlink( slot );
+      auto &l = channels[ get_channel( v.note.channel_note ) ];
+      if( v.channel_prev != none ) voices[ v.channel_prev ].channel_next = v.channel_next;
+      else l.head = v.channel_next;
+      if( v.channel_next != none ) voices[ v.channel_next ].channel_prev = v.channel_prev;
+      else l.tail = v.channel_prev;
+      v.channel_prev = none;
+      v.channel_next = none;
+      by_note[ get_index( v.note.channel_note ) ] = none;
+      v.state = voice_state_t::free;
+    }
+    void move( slot_t slot, voice_state_t state ) {
+      unlink( slot );
+      link( slot, state );
+    }
+    template< typename F >
+    void for_each( voice_state_t state, F &&func ) const {
+      for( auto slot = lists[ int( state ) ].head; slot != none; slot = voices[ slot ].next )
+        func( voices[ slot ].note );
+    }
+    template< typename F >
+    void for_each_in_channel( channel_t channel, F &&func ) const {
+      for( auto slot = channels[ channel & 0x0Fu ].head; slot != none; slot = voices[ slot ].channel_next )
+        func( voices[ slot ].note );
+    }
+  private:
+    struct voice_t {
+      voice_t() : state( voice_state_t::free ), prev( none ), next( none ), channel_prev( none ), channel_next( none ) {}
+      active_note_t note;
+      voice_state_t state;
+      slot_t prev;
+      slot_t next;
+      slot_t channel_prev;
+      slot_t channel_next;
+    };
+    struct list_t {
+      slot_t head;
+      slot_t tail;
+    };
+    static size_t get_channel( uint16_t channel_note ) {
+      return size_t( channel_note >> 8 ) & 0x0Fu;
+    }
+    static size_t get_index( uint16_t channel_note ) {
+      return get_channel( channel_note ) * 128u + ( channel_note & 0x7Fu );
+    }
+    void link( slot_t slot, voice_state_t state ) {
+      auto &v = voices[ slot ];
+      auto &l = lists[ int( state ) ];
+      v.state = state;
+      v.prev = l.tail;
+      v.next = none;
+      if( l.tail != none ) voices[ l.tail ].next = slot;
+      else l.head = slot;
+      l.tail = slot;
+    }
+    void unlink( slot_t slot ) {
+      auto &v = voices[ slot ];
+      auto &l = lists[ int( v.state ) ];
+      if( v.prev != none ) voices[ v.prev ].next = v.next;
+      else l.head = v.next;
+      if( v.next != none ) voices[ v.next ].prev = v.prev;
+      else l.tail = v.prev;
+      v.prev = none;
+      v.next = none;
+    }
+    std::vector< voice_t > voices;
+    std::array< slot_t, 16u * 128u > by_note;
+    std::array< list_t, 3u > lists;
+    std::array< list_t, 16u > channels;
+    std::vector< uint64_t > available;
+  };
+}
+
+#endif
+
@@ -0,0 +1,349 @@
+#ifndef SMFP_VOICE_JOB_HPP
+#define SMFP_VOICE_JOB_HPP
+
+#include <cmath>
+#include <chrono>
+#include <limits>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <iterator>
+#include <unordered_map>
+#include <stamp/setter.hpp>
+#include <smfp/types.hpp>
+#include <smfp/channel_state.hpp>
+#include <smfp/active_note.hpp>
+#include <smfp/mixer.hpp>
+#include <smfp/midi_parser.hpp>
+#include <smfp/schedule.hpp>
+#include <smfp/coalesce.hpp>
+
+namespace smfp {
+  enum class voice_event_id_t {
+    note_on,
+    note_off,
+    clear,
+    set_program,
+    set_variable,
+    set_volume,
+    set_frequency,
+    system_exclusive
+  };
+  struct voice_event_t {
+    voice_event_t() : at( 0 ), id( voice_event_id_t::clear ), state( 0 ), variable( channel_variable_id_t::bank ), variable_at( 0 ), program( 0 ), value( 0.f ), sysex_begin( 0 ), sysex_end( 0 ) {}
+    LIBSTAMP_SETTER( at )
+    LIBSTAMP_SETTER( id )
+    LIBSTAMP_SETTER( state )
+    LIBSTAMP_SETTER( note )
+    LIBSTAMP_SETTER( variable )
+    LIBSTAMP_SETTER( variable_at )
+    LIBSTAMP_SETTER( program )
+    LIBSTAMP_SETTER( value )
+    LIBSTAMP_SETTER( sysex_begin )
+    LIBSTAMP_SETTER( sysex_end )
+    uint64_t at;
+    voice_event_id_t id;
+    uint32_t state;
+    active_note_t note;
+    channel_variable_id_t variable;
+    note_t variable_at;
+    uint8_t program;
+    float value;
+    uint32_t sysex_begin;
+    uint32_t sysex_end;
+  };
+  // 1つのスロットでnote_onから次のnote_onまでに発生したイベント
+  struct voice_job_t {
+    voice_job_t() : slot( 0 ), begin( 0 ), end( std::numeric_limits< uint64_t >::max() ) {}
+    LIBSTAMP_SETTER( slot )
+    LIBSTAMP_SETTER( begin )
+    LIBSTAMP_SETTER( end )
+    slot_t slot;
+    uint64_t begin;
+    uint64_t end;
+    std::vector< voice_event_t > events;
+  };
+  struct voice_jobs_t {
+    voice_jobs_t() : length( 0 ) {}
+    std::vector< voice_job_t > jobs;
+    // global_stateはnullptrにしてある
+    std::vector< channel_state_t > states;
+    std::vector< uint8_t > sysex;
+    uint64_t length;
+  };
+  class voice_recorder_t;
+  class voice_recorder_slot_t {
+  public:
+    voice_recorder_slot_t( voice_recorder_t *recorder_, slot_t slot_ ) : recorder( recorder_ ), slot( slot_ ) {}
+    void note_on( const channel_state_t &cst, const active_note_t &nst );
+    void note_off( const channel_state_t &cst );
+    void clear( const channel_state_t &cst );
+    void set_program( const channel_state_t &cst, uint8_t prog );
+    void set_variable( channel_variable_id_t id, note_t at, const channel_state_t &cst );
+    void set_volume( const channel_state_t &cst, float value );
+    void set_frequency( const channel_state_t &cst, float value );
+    template< typename Iterator >
+    void system_exclusive( const channel_state_t &cst, Iterator begin, Iterator end );
+  private:
+    voice_recorder_t *recorder;
+    slot_t slot;
+  };
+  // midi_parser_tのハンドラとして振る舞い、音を出さずにスロット毎のイベント列を記録する
+  class voice_recorder_t {
+  public:
+    voice_recorder_t( size_t slot_count ) : position( 0 ), current( slot_count, no_job ) {
+      slots.reserve( slot_count );
+      for( size_t i = 0; i != slot_count; ++i )
+        slots.emplace_back( this, slot_t( i ) );
+    }
+    voice_recorder_t( const voice_recorder_t& ) = delete;
+    voice_recorder_t &operator=( const voice_recorder_t& ) = delete;
+    size_t size() const {
+      return slots.size();
+    }
+    voice_recorder_slot_t &operator[]( size_t i ) {
+      return slots[ i ];
+    }
+    void set_position( uint64_t p ) {
+      position = p;
+    }
+    uint64_t get_position() const {
+      return position;
+    }
+    voice_jobs_t finish() {
+      for( auto &job: result.jobs )
+        job.end = std::min( job.end, position );
+      result.length = position;
+      std::fill( current.begin(), current.end(), no_job );
+      last_state.clear();
+      return std::move( result );
+    }
+  private:
+    friend class voice_recorder_slot_t;
+    constexpr static size_t no_job = std::numeric_limits< size_t >::max();
+    void begin_job( slot_t slot ) {
+      if( current[ slot ] != no_job )
+        result.jobs[ current[ slot ] ].end = position;
+      current[ slot ] = result.jobs.size();
+      result.jobs.push_back(
+        voice_job_t()
+          .set_slot( slot )
+          .set_begin( position )
+      );
+    }
+    voice_event_t *add_event( slot_t slot, voice_event_id_t id, const channel_state_t &cst ) {
+      if( current[ slot ] == no_job ) return nullptr;
+      auto &job = result.jobs[ current[ slot ] ];
+      // global_stateはパーサと一緒に消えるので、記録する状態からは参照しない
+      auto stored = cst;
+      stored.global_state = nullptr;
+      auto [last,is_new] = last_state.insert( std::make_pair( &cst, uint32_t( result.states.size() ) ) );
+      if( is_new || !( result.states[ last->second ] == stored ) ) {
+        last->second = result.states.size();
+        result.states.push_back( std::move( stored ) );
+      }
+      const auto state = last->second;
+      job.events.push_back(
+        voice_event_t()
+          .set_at( position )
+          .set_id( id )
+          .set_state( state )
+      );
+      return &job.events.back();
+    }
+    template< typename Iterator >
+    std::pair< uint32_t, uint32_t > add_sysex( Iterator begin, Iterator end ) {
+      const uint32_t sysex_begin = result.sysex.size();
+      std::copy( begin, end, std::back_inserter( result.sysex ) );
+      return std::make_pair( sysex_begin, uint32_t( result.sysex.size() ) );
+    }
+    uint64_t position;
+    std::vector< voice_recorder_slot_t > slots;
+    std::vector< size_t > current;
+    std::unordered_map< const channel_state_t*, uint32_t > last_state;
+    voice_jobs_t result;
+  };
+  inline void voice_recorder_slot_t::note_on( const channel_state_t &cst, const active_note_t &nst ) {
+    recorder->begin_job( slot );
+    recorder->add_event( slot, voice_event_id_t::note_on, cst )->set_note( nst );
+  }
+  inline void voice_recorder_slot_t::note_off( const channel_state_t &cst ) {
+    recorder->add_event( slot, voice_event_id_t::note_off, cst );
+  }
+  inline void voice_recorder_slot_t::clear( const channel_state_t &cst ) {
+    recorder->add_event( slot, voice_event_id_t::clear, cst );
+  }
+  inline void voice_recorder_slot_t::set_program( const channel_state_t &cst, uint8_t prog ) {
+    if( auto e = recorder->add_event( slot, voice_event_id_t::set_program, cst ) )
+      e->set_program( prog );
+  }
+  inline void voice_recorder_slot_t::set_variable( channel_variable_id_t id, note_t at, const channel_state_t &cst ) {
+    if( auto e = recorder->add_event( slot, voice_event_id_t::set_variable, cst ) )
+      e->set_variable( id ).set_variable_at( at );
+  }
+  inline void voice_recorder_slot_t::set_volume( const channel_state_t &cst, float value ) {
+    if( auto e = recorder->add_event( slot, voice_event_id_t::set_volume, cst ) )
+      e->set_value( value );
+  }
+  inline void voice_recorder_slot_t::set_frequency( const channel_state_t &cst, float value ) {
+    if( auto e = recorder->add_event( slot, voice_event_id_t::set_frequency, cst ) )
+      e->set_value( value );
+  }
+  template< typename Iterator >
+  void voice_recorder_slot_t::system_exclusive( const channel_state_t &cst, Iterator begin, Iterator end ) {
+    if( auto e = recorder->add_event( slot, voice_event_id_t::system_exclusive, cst ) ) {
+      const auto [sysex_begin,sysex_end] = recorder->add_sysex( begin, end );
+      e->set_sysex_begin( sysex_begin ).set_sysex_end( sysex_end );
+    }
+  }
+  // トラックを最後まで進めてスロット毎のイベント列を記録する
+  template< typename Tracks >
+  voice_jobs_t record_voice_jobs( Tracks &tracks, size_t slot_count, std::chrono::nanoseconds step, size_t block_size ) {
+    voice_recorder_t recorder( slot_count );
+    midi_parser_t parser( recorder );
+    controller_coalescer_t coalescer( parser );
+    uint64_t position = 0;
+    while( !tracks.end() ) {
+      play_block( tracks, coalescer, step, block_size, [&]( size_t, size_t to ) {
+        recorder.set_position( position + to );
+      } );
+      coalescer.flush();
+      position += block_size;
+    }
+    return recorder.finish();
+  }
+  template< typename Instrument >
+  void apply_voice_event( Instrument &inst, const voice_jobs_t &jobs, const voice_event_t &e ) {
+    const auto &cst = jobs.states[ e.state ];
+    if( e.id == voice_event_id_t::note_on ) inst.note_on( cst, e.note );
+    else if( e.id == voice_event_id_t::note_off ) inst.note_off( cst );
+    else if( e.id == voice_event_id_t::clear ) inst.clear( cst );
+    else if( e.id == voice_event_id_t::set_program ) inst.set_program( cst, e.program );
+    else if( e.id == voice_event_id_t::set_variable ) inst.set_variable( e.variable, e.variable_at, cst );
+    else if( e.id == voice_event_id_t::set_volume ) inst.set_volume( cst, e.value );
+    else if( e.id == voice_event_id_t::set_frequency ) inst.set_frequency( cst, e.value );
+    else if( e.id == voice_event_id_t::system_exclusive )
+      inst.system_exclusive( cst, std::next( jobs.sysex.data(), e.sysex_begin ), std::next( jobs.sysex.data(), e.sysex_end ) );
+  }
+  // 記録されたジョブを1つずつ独立したボイスとして再生する
+  template< typename Instrument >
+  class voice_job_player_t {
+  public:
+    voice_job_player_t( const voice_jobs_t &jobs_, size_t job_, const Instrument &prototype ) :
+      jobs( &jobs_ ), job( job_ ), inst( prototype ), position( jobs_.jobs[ job_ ].begin ), next_event( 0 ) {}
+    size_t get_job() const {
+      return job;
+    }
+    bool is_end() const {
+      const auto &j = jobs->jobs[ job ];
+      return position >= j.end || ( next_event == j.events.size() && inst.is_end() );
+    }
+    // [begin,end)のうちこのボイスが鳴っている区間を書き込み、それ以外には0を書き込む
+    void operator()( std::chrono::nanoseconds step, uint64_t begin, uint64_t end, float *val, float *env ) {
+      const auto &j = jobs->jobs[ job ];
+      std::fill( val, std::next( val, end - begin ), 0.f );
+      std::fill( env, std::next( env, end - begin ), 0.f );
+      position = std::max( position, begin );
+      const auto stop = std::min( end, j.end );
+      while( position < stop && !is_end() ) {
+        while( next_event != j.events.size() && j.events[ next_event ].at <= position )
+          apply_voice_event( inst, *jobs, j.events[ next_event++ ] );
+        const auto span_end = ( next_event != j.events.size() ) ?
+          std::min( stop, j.events[ next_event ].at ) : stop;
+        // 鳴り終わったボイスを描画し続けないように、最後のイベントの後は短く区切って終わりを確かめる
+        while( position != span_end ) {
+          const auto chunk_end = ( next_event == j.events.size() ) ?
+            std::min( span_end, position + chunk_size ) : span_end;
+          inst.mix( step, std::next( val, position - begin ), std::next( env, position - begin ), chunk_end - position );
+          position = chunk_end;
+          if( next_event == j.events.size() && inst.is_end() ) break;
+        }
+      }
+    }
+  private:
+    static constexpr uint64_t chunk_size = 64u;
+    const voice_jobs_t *jobs;
+    size_t job;
+    Instrument inst;
+    uint64_t position;
+    size_t next_event;
+  };
+  // 指定されたジョブをタイル毎に並列に描画し、スロット順に足し合わせた値をタイル毎に渡す
+  // ボイス毎の描画結果はslice_sizeサンプルずつしか持たないので、同時に鳴るボイスが多くてもメモリを使い過ぎない
+  template< typename Instrument, typename Consumer >
+  void sum_voice_jobs(
+    const voice_jobs_t &jobs,
+    std::vector< size_t > order,
+    const Instrument &prototype,
+    std::chrono::nanoseconds step,
+    Consumer &consumer,
+    size_t tile_size = 65536u,
+    size_t slice_size = 4096u
+  ) {
+    std::stable_sort( order.begin(), order.end(), [&]( size_t l, size_t r ) {
+      return jobs.jobs[ l ].begin < jobs.jobs[ r ].begin;
+    } );
+    auto next_job = order.begin();
+    std::vector< voice_job_player_t< Instrument > > players;
+    std::vector< float > val;
+    std::vector< float > env;
+    std::vector< float > val_sum;
+    std::vector< float > env_sum;
+    for( uint64_t tile_begin = 0; tile_begin < jobs.length; tile_begin += tile_size ) {
+      const uint64_t tile_end = std::min( tile_begin + tile_size, jobs.length );
+      const size_t length = tile_end - tile_begin;
+      for( ; next_job != order.end() && jobs.jobs[ *next_job ].begin < tile_end; ++next_job )
+        players.emplace_back( jobs, *next_job, prototype );
+      std::stable_sort( players.begin(), players.end(), [&]( const auto &l, const auto &r ) {
+        return jobs.jobs[ l.get_job() ].slot < jobs.jobs[ r.get_job() ].slot;
+      } );
+      val.resize( players.size() * slice_size );
+      env.resize( players.size() * slice_size );
+      val_sum.assign( length, 0.f );
+      env_sum.assign( length, 0.f );
+      for( uint64_t slice_begin = tile_begin; slice_begin < tile_end; slice_begin += slice_size ) {
+        const uint64_t slice_end = std::min( slice_begin + slice_size, tile_end );
+        const size_t offset = slice_begin - tile_begin;
+#pragma omp parallel for schedule( dynamic )
+        for( size_t i = 0; i < players.size(); ++i )
+          players[ i ]( step, slice_begin, slice_end, std::next( val.data(), i * slice_size ), std::next( env.data(), i * slice_size ) );
+#pragma omp parallel for
+        for( size_t t = 0; t < slice_end - slice_begin; ++t ) {
+          for( size_t i = 0; i != players.size(); ++i ) {
+            val_sum[ offset + t ] += val[ i * slice_size + t ];
+            env_sum[ offset + t ] += env[ i * slice_size + t ];
+          }
+        }
+      }
+      consumer( tile_begin, val_sum, env_sum );
+      players.erase(
+        std::remove_if( players.begin(), players.end(), []( const auto &p ) { return p.is_end(); } ),
+        players.end()
+      );
+    }
+  }
+  // ボイス間の依存はミキサーのAGCだけなので、タイル毎に全ボイスを並列に描画して
+  // スロット順に足し合わせた後AGCを逐次適用する
+  template< typename Instrument, typename Sink >
+  void render_voice_jobs(
+    const voice_jobs_t &jobs,
+    const Instrument &prototype,
+    std::chrono::nanoseconds step,
+    mixer_t &mixer,
+    Sink &sink,
+    size_t tile_size = 65536u
+  ) {
+    std::vector< size_t > order( jobs.jobs.size() );
+    for( size_t i = 0; i != order.size(); ++i ) order[ i ] = i;
+    std::vector< float > output;
+    auto consumer = [&]( uint64_t, const std::vector< float > &val_sum, const std::vector< float > &env_sum ) {
+      output.resize( val_sum.size() );
+      for( size_t t = 0; t != val_sum.size(); ++t )
+        output[ t ] = mixer( val_sum[ t ], env_sum[ t ] );
+      sink( output );
+    };
+    sum_voice_jobs( jobs, std::move( order ), prototype, step, consumer, tile_size );
+  }
+}
+
+#endif
@@ -3,35 +3,79 @@
 
 #include <cstdint>
 #include <array>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include <algorithm>
+#include <iterator>
 #include <sndfile.h>
 
 namespace smfp {
+  enum class sample_format_t {
+    pcm16,
+    pcm24,
+    float32
+  };
+  // 受け取ったサンプルをバッファに溜め、変換とエンコードと書き込みは別のスレッドで行う
+  // バッファは使い回すので、書き込みが追い付いている間は描画するスレッドがディスクを待つことはない
+  // ファイル名の拡張子が.flacか.oggならlibsndfileで圧縮して書く
   class wavesink {
   public:
-    wavesink( const char *filename, uint32_t sample_rate );
+    wavesink( const char *filename, uint32_t sample_rate, sample_format_t format_ = sample_format_t::pcm16, bool dither_ = false );
     ~wavesink();
+    wavesink( const wavesink& ) = delete;
+    wavesink &operator=( const wavesink& ) = delete;
+    // 残りのサンプルを書き込んでからファイルを閉じる
+    // 書き込みに失敗していたら例外を投げるので、書き終えたことを報告する前に呼ぶ
+    void close();
+    // 溜まっているサンプルをバッファが一杯になるのを待たずに書き込みスレッドに渡す
+    // 実時間で再生する時はブロック毎に呼んで、submit_size分の遅延が付かないようにする
+    void flush();
     void play_if_not_playing() const;
     bool buffer_is_ready() const;
     void operator()( const float data );
     template< size_t i >
     void operator()( const std::array< int16_t, i > &data ) {
-      sf_write_short( file, data.data(), i );
+      std::transform( data.begin(), data.end(), std::back_inserter( current ), []( int16_t value ) { return value / 32767.f; } );
+      submit_if_full();
     }
     template< size_t i >
     void operator()( const std::array< float, i > &data ) {
-      std::array< int16_t, i > idata;
-      std::transform( data.begin(), data.end(), idata.begin(), []( const float &value ) { return int16_t( value * 32767 ); } );
-      sf_write_short( file, idata.data(), i );
+      write( data.data(), data.size() );
     }
     void operator()( const std::vector< float > &data ) {
-      std::vector< int16_t > idata( data.size() );
-      std::transform( data.begin(), data.end(), idata.begin(), []( const float &value ) { return int16_t( value * 32767 ); } );
-      sf_write_short( file, idata.data(), idata.size() );
+      write( data.data(), data.size() );
     }
   private:
+    void write( const float *data, size_t size );
+    void submit_if_full();
+    void submit();
+    void finish();
+    void run();
+    // 書き込みスレッドで出力の形式に変換して書き込む
+    void write_block( const std::vector< float > &data );
     SF_INFO config;
     SNDFILE* file;
+    sample_format_t format;
+    bool dither;
+    // TPDFディザ用の乱数の状態
+    uint32_t seed;
+    // 書き込みスレッドが変換に使うバッファ
+    std::vector< int16_t > short_buffer;
+    std::vector< int > int_buffer;
+    std::vector< float > dither_buffer;
+    std::mutex guard;
+    std::condition_variable cond;
+    // 空いているバッファと書き込み待ちのバッファ
+    std::vector< std::vector< float > > free;
+    std::deque< std::vector< float > > filled;
+    // 描画するスレッドが書き込んでいるバッファ
+    std::vector< float > current;
+    bool stopping;
+    bool failed;
+    std::thread writer;
   };
 }
 
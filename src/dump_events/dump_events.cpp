@@ -2,9 +2,14 @@
 #include <smfp/track.hpp>
 #include <smfp/midi_parser.hpp>
 #include <smfp/dummy_handler.hpp>
+#include <smfp/mixer.hpp>
+#include <smfp/seek.hpp>
+#include <smfp/load_profile.hpp>
+#include <algorithm>
 #include <chrono>
 #include <iostream>
 #include <vector>
+#include <cmath>
 #include <cstdint>
 #include <boost/program_options.hpp>
 #include <stamp/mapped_file.hpp>
@@ -13,7 +18,14 @@ int main( int argc, char* argv[] ) {
   boost::program_options::options_description options("Options");
   options.add_options()
     ("help,h",    "show this message")
-    ("input,i", boost::program_options::value<std::string>(),  "input file");
+    ("input,i", boost::program_options::value<std::string>(),  "input file")
+    ("start", boost::program_options::value<double>(), "skip events before this many seconds")
+    ("analyze,a", "play the file as fast as possible and print the estimated rendering load as JSON")
+    ("polyphony", boost::program_options::value<size_t>()->default_value( 64u ), "number of voices assumed by --analyze")
+    ("release", boost::program_options::value<double>()->default_value( 0.5 ), "seconds a voice keeps sounding after note off in --analyze")
+    ("interval", boost::program_options::value<double>()->default_value( 1.0 ), "length in seconds of each interval reported by --analyze")
+    ("voice-cost", boost::program_options::value<double>()->default_value( 60.0 ), "nanoseconds to render one sample of a sounding voice")
+    ("idle-cost", boost::program_options::value<double>()->default_value( 15.0 ), "nanoseconds to render one sample of a silent voice");
   boost::program_options::variables_map params;
   boost::program_options::store( boost::program_options::parse_command_line( argc, argv, options ), params );
   boost::program_options::notify( params );
@@ -24,10 +36,42 @@ int main( int argc, char* argv[] ) {
   stamp::mapped_file f( params["input"].as< std::string >() );
   auto [iter,header] = smfp::decode_smf_header( f.begin(), f.end() );
   smfp::smf_tracks_t tracks( header, iter, f.end() );
+  if( params.count( "analyze" ) ) {
+    const auto polyphony = params["polyphony"].as< size_t >();
+    const auto interval = params["interval"].as< double >();
+    if( polyphony == 0u || polyphony >= 255u || interval <= 0.0 ) {
+      std::cerr << "polyphony must be between 1 and 254 and interval must be positive" << std::endl;
+      return 1;
+    }
+    smfp::load_profile_t profile(
+      polyphony,
+      std::chrono::nanoseconds( uint64_t( std::max( params["release"].as< double >(), 0.0 ) * 1.e9 ) ),
+      std::chrono::nanoseconds( std::max( uint64_t( interval * 1.e9 ), uint64_t( 1u ) ) )
+    );
+    smfp::midi_parser_t midip( profile.get_voices() );
+    auto counter = profile.get_counter( midip );
+    uint64_t now = 0u;
+    while( !tracks.end() ) {
+      const auto distance = tracks.get_distance();
+      now += distance.count();
+      profile.advance( now );
+      tracks( distance, counter );
+    }
+    std::cout << profile.to_json( std::chrono::nanoseconds( 1000ul * 1000ul * 1000ul / 44100ul ), params["voice-cost"].as< double >(), params["idle-cost"].as< double >() ).dump( 2 ) << std::endl;
+    return 0;
+  }
   std::vector< smfp::dummy_handler > handlers( 64, smfp::dummy_handler() );
   smfp::midi_parser_t midip( handlers );
   auto unit_step = std::chrono::nanoseconds( 1000ul * 1000ul * 1000ul / 44100ul );
   uint64_t count = 0;
+  if( params.count( "start" ) ) {
+    // 読み飛ばす間のイベントは表示しない
+    smfp::mixer_t mixer( unit_step );
+    for( auto &h: handlers ) h.set_quiet( true );
+    const auto samples = smfp::seek( tracks, midip, handlers, mixer, unit_step, 441u, uint64_t( std::round( std::max( params["start"].as< double >(), 0.0 ) * 44100.0 ) ) );
+    for( auto &h: handlers ) h.set_quiet( false );
+    count = ( unit_step * samples ).count();
+  }
   while( !tracks.end() ) {
     auto sleep = tracks.get_distance();
     std::this_thread::sleep_for( sleep );
@@ -30,6 +30,7 @@ SOFTWARE.
 #include <nlohmann/json.hpp>
 #include <smfp/2op.hpp>
 #include <smfp/variable.hpp>
+#include <smfp/instrument.hpp>
 #include <smfp/wavesink.hpp>
 
 int main( int argc, char *argv[] ) {
@@ -59,16 +60,16 @@ int main( int argc, char *argv[] ) {
     }
     config = configs[ "instruments" ][ prog ];
   }
-  using inst_t = smfp::variable_t< smfp::fm_2op_nofb_t >;
+  using inst_t = smfp::instrument_t;
   using config_t = inst_t::config_type;
   std::shared_ptr< config_t > config_p( new config_t( config ) );
   inst_t inst( config_p );
   smfp::global_state_t gst;
   smfp::channel_state_t cst( &gst );
-  cst[ smfp::channel_variable_id_t::volume ] = 0x3FFF;
-  cst[ smfp::channel_variable_id_t::expression ] = 0x3FFF;
-  cst[ smfp::channel_variable_id_t::foot ] = 0x3FFF;
-  cst[ smfp::channel_variable_id_t::breath ] = 0x3FFF;
+  cst.set( smfp::channel_variable_id_t::volume, 0x3FFF );
+  cst.set( smfp::channel_variable_id_t::expression, 0x3FFF );
+  cst.set( smfp::channel_variable_id_t::foot, 0x3FFF );
+  cst.set( smfp::channel_variable_id_t::breath, 0x3FFF );
   cst.set_pressure( 0x7F );
   smfp::active_note_t nst;
   nst.set_channel_note( params[ "note" ].as<int>() & 0x7F );
@@ -0,0 +1,151 @@
+/*
+Copyright (c) 2020 Naomasa Matsubayashi
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <cmath>
+#include <algorithm>
+#include "ifm/additive.h"
+
+namespace ifm {
+  namespace {
+    // 窓関数のスペクトルのうち合成に使う片側の幅(ビン)
+    constexpr int kernel_width = 4;
+    constexpr int kernel_oversample = 64;
+    constexpr int max_sideband = 64;
+    // J_0( x )からJ_count( x )までを後退漸化式(Millerの方法)でまとめて求める
+    void generate_bessel( float x, int count, std::vector< float > &bessel ) {
+      bessel.assign( count + 1, 0.f );
+      if( x == 0.f ) {
+        bessel[ 0 ] = 1.f;
+        return;
+      }
+      const int start = ( ( std::max( count, int( x ) ) + 20 ) / 2 ) * 2;
+      double next = 0.;
+      double current = 1.e-30;
+      double norm = 0.;
+      for( int k = start; k > 0; --k ) {
+        const double prev = 2. * k / x * current - next;
+        next = current;
+        current = prev;
+        if( std::abs( current ) > 1.e10 ) {
+          current *= 1.e-10;
+          next *= 1.e-10;
+          norm *= 1.e-10;
+          for( auto &v: bessel ) v *= 1.e-10f;
+        }
+        if( k - 1 <= count ) bessel[ k - 1 ] = current;
+        if( ( k - 1 ) % 2 == 0 && k - 1 != 0 ) norm += 2. * current;
+      }
+      norm += current;
+      for( auto &v: bessel ) v /= norm;
+    }
+  }
+  additive_synth_t::additive_synth_t( std::chrono::nanoseconds step_, size_t res ) :
+    step( step_ ),
+    resolution( res ),
+    hop( res / 2 ),
+    filled( 0u ),
+    bins_per_hz( std::chrono::duration_cast< std::chrono::duration< float > >( step_ ).count() * res ),
+    ifft( res ),
+    spectrum( res / 2 + 1 ),
+    frame( res ),
+    tail( res / 2 ),
+    env_sums( res / 2 ),
+    output( res / 2 ) {
+    // フレームの中心を位相の基準にしたハン窓のスペクトル(実数になる)
+    kernel.resize( 2 * kernel_width * kernel_oversample + 2 );
+    for( unsigned int i = 0; i != kernel.size(); ++i ) {
+      const double distance = double( i ) / kernel_oversample - kernel_width;
+      double sum = 0.;
+      for( unsigned int n = 0; n != resolution; ++n ) {
+        const double window = ( 1. - std::cos( 2. * M_PI * n / resolution ) ) / 2.;
+        sum += window * std::cos( 2. * M_PI * distance * ( double( n ) - double( hop ) ) / resolution );
+      }
+      kernel[ i ] = sum / resolution;
+    }
+  }
+  float additive_synth_t::get_kernel( float distance ) const {
+    const float pos = ( distance + kernel_width ) * kernel_oversample;
+    const auto index = size_t( pos );
+    const float frac = pos - float( index );
+    return std::lerp( kernel[ index ], kernel[ index + 1 ], frac );
+  }
+  void additive_synth_t::add_sinusoid( float amplitude, float phase, float frequency ) {
+    if( frequency < 0.f ) {
+      amplitude = -amplitude;
+      phase = -phase;
+      frequency = -frequency;
+    }
+    // ナイキスト周波数に窓の幅がかかる側帯波は捨てる
+    if( frequency >= float( int( hop ) - kernel_width ) ) return;
+    phase -= std::floor( phase );
+    const std::complex< float > coef(
+      amplitude / 2.f * std::sin( 2.f * float( M_PI ) * phase ),
+      -amplitude / 2.f * std::cos( 2.f * float( M_PI ) * phase )
+    );
+    const int begin = std::max( 0, int( std::ceil( frequency - kernel_width ) ) );
+    const int end = int( std::floor( frequency + kernel_width ) );
+    for( int k = begin; k <= end; ++k ) {
+      const auto value = coef * get_kernel( float( k ) - frequency );
+      spectrum[ k ] += ( k % 2 ) ? -value : value;
+    }
+    // 負の周波数側の成分が直流付近にかかる場合
+    for( int k = 0; float( k ) + frequency <= float( kernel_width ); ++k ) {
+      const auto value = std::conj( coef ) * get_kernel( float( k ) + frequency );
+      spectrum[ k ] += ( k % 2 ) ? -value : value;
+    }
+  }
+  void additive_synth_t::add( const smfp::fm_2op_nofb_partials_t &partials ) {
+    if( partials.gain == 0.f ) return;
+    const float carrier = partials.carrier_frequency * bins_per_hz;
+    const float modulator = partials.modulator_frequency * bins_per_hz;
+    float index = partials.index;
+    float modulator_phase = partials.modulator_phase;
+    modulator_phase -= std::floor( modulator_phase );
+    // J_n( -b ) = (-1)^n J_n( b ) なので変調波の位相を半周期ずらして正にする
+    if( index < 0.f ) {
+      index = -index;
+      modulator_phase += 0.5f;
+    }
+    const int count = ( index == 0.f ) ? 0 : std::min( int( std::ceil( index ) ) + 3, max_sideband );
+    generate_bessel( index, count, bessel );
+    for( int n = 0; n <= count; ++n ) {
+      const float amplitude = partials.gain * bessel[ n ];
+      add_sinusoid( amplitude, partials.carrier_phase + n * modulator_phase, carrier + n * modulator );
+      if( n != 0 )
+        add_sinusoid( ( n % 2 ) ? -amplitude : amplitude, partials.carrier_phase - n * modulator_phase, carrier - n * modulator );
+    }
+  }
+  const std::vector< float > &additive_synth_t::synthesize( smfp::mixer_t &mixer ) {
+    ifft.inverse( spectrum, frame );
+    std::fill( spectrum.begin(), spectrum.end(), std::complex< float >( 0.f, 0.f ) );
+    output.resize( hop );
+    for( size_t i = 0u; i != hop; ++i ) {
+      output[ i ] = tail[ i ] + frame[ i ];
+      tail[ i ] = frame[ i + hop ];
+    }
+    output.resize( filled );
+    for( size_t i = 0u; i != filled; ++i )
+      output[ i ] = mixer( output[ i ], env_sums[ i ] );
+    filled = 0u;
+    return output;
+  }
+}
@@ -28,7 +28,10 @@ SOFTWARE.
 #include <complex>
 #include <exception>
 #include <stdexcept>
+#include <algorithm>
+#include <iterator>
 #ifdef ENABLE_FFTW3
+#include <mutex>
 #include <fftw3.h>
 #else
 #include <pffft.hpp>
@@ -36,6 +39,12 @@ SOFTWARE.
 #include "ifm/fft.h"
 
 namespace ifm {
+#ifdef ENABLE_FFTW3
+  std::mutex &get_fftw_plan_mutex() {
+    static std::mutex guard;
+    return guard;
+  }
+#endif
   fft_context_t::fft_context_t( size_t res, float sample_rate_ ) :
 #ifdef ENABLE_FFTW3
     input( reinterpret_cast< float* >( fftwf_malloc( sizeof( float ) * res ) ) ),
@@ -50,7 +59,10 @@ namespace ifm {
   {
 #ifdef ENABLE_FFTW3
     if( !input || !output ) throw std::bad_alloc();
-    plan.reset( fftwf_plan_dft_r2c_1d( resolution, input.get(), output.get(), FFTW_ESTIMATE ) );
+    {
+      std::lock_guard< std::mutex > lock( get_fftw_plan_mutex() );
+      plan.reset( fftwf_plan_dft_r2c_1d( resolution, input.get(), output.get(), FFTW_ESTIMATE ) );
+    }
     if( !plan ) throw std::bad_alloc();
 #endif
     window.resize( resolution );
@@ -82,5 +94,43 @@ namespace ifm {
     result.resize( i );
     return result;
   }
+  ifft_context_t::ifft_context_t( size_t res ) :
+#ifdef ENABLE_FFTW3
+    input( reinterpret_cast< fftwf_complex* >( fftwf_malloc( sizeof( fftwf_complex ) * ( res / 2 + 1 ) ) ) ),
+    output( reinterpret_cast< float* >( fftwf_malloc( sizeof( float ) * res ) ) ),
+#else
+    fft( res ),
+    input( fft.spectrumVector() ),
+    output( fft.valueVector() ),
+#endif
+    resolution( res )
+  {
+#ifdef ENABLE_FFTW3
+    if( !input || !output ) throw std::bad_alloc();
+    {
+      std::lock_guard< std::mutex > lock( get_fftw_plan_mutex() );
+      plan.reset( fftwf_plan_dft_c2r_1d( resolution, input.get(), output.get(), FFTW_ESTIMATE ) );
+    }
+    if( !plan ) throw std::bad_alloc();
+#endif
+  }
+  void ifft_context_t::inverse( const std::vector< std::complex< float > > &input_, std::vector< float > &output_ ) {
+    if( input_.size() != resolution / 2 + 1 ) throw incompatible_range();
+    output_.resize( resolution );
+#ifdef ENABLE_FFTW3
+    for( unsigned int i = 0; i != input_.size(); ++i ) {
+      input.get()[ i ][ 0 ] = input_[ i ].real();
+      input.get()[ i ][ 1 ] = input_[ i ].imag();
+    }
+    fftwf_execute( plan.get() );
+    std::copy( output.get(), output.get() + resolution, output_.begin() );
+#else
+    // PFFFTの実数変換は直流とナイキスト周波数の実部を先頭の要素にまとめる
+    input[ 0 ] = std::complex< float >( input_[ 0 ].real(), input_[ resolution / 2 ].real() );
+    std::copy( std::next( input_.begin() ), std::prev( input_.end() ), std::next( input.begin() ) );
+    fft.inverse( input, output );
+    std::copy( output.begin(), output.end(), output_.begin() );
+#endif
+  }
 }
 
@@ -3,6 +3,8 @@
 #include <smfp/exceptions.hpp>
 #include <smfp/header.hpp>
 #include <smfp/track.hpp>
+#include <smfp/timeline.hpp>
+#include <smfp/stream.hpp>
 #include <smfp/get_volume.hpp>
 #include <smfp/get_frequency.hpp>
 #include <smfp/midi_parser.hpp>
@@ -14,13 +16,28 @@
 #include <smfp/2op.hpp>
 #include <smfp/variable.hpp>
 #include <smfp/multi_instruments.hpp>
+#include <smfp/instrument.hpp>
 #include <smfp/wavesink.hpp>
+#include <smfp/voice_job.hpp>
+#include <smfp/stem.hpp>
+#include <smfp/segment.hpp>
+#include <smfp/seek.hpp>
+#include <smfp/live.hpp>
+#include <smfp/coalesce.hpp>
+#include <smfp/schedule.hpp>
+#include <ifm/additive.h>
+#include <omp.h>
 #include <chrono>
 #include <array>
 #include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <optional>
+#include <cctype>
+#include <filesystem>
+#include <sstream>
+#include <cmath>
 #include <cstdint>
 #include <boost/program_options.hpp>
 #include <nlohmann/json.hpp>
@@ -30,39 +47,288 @@ int main( int argc, char* argv[] ) {
   boost::program_options::options_description options("Options");
   options.add_options()
     ("help,h",    "show this message")
-    ("config,c", boost::program_options::value<std::string>(), "config file")
-    ("input,i", boost::program_options::value<std::string>(), "input file")
-    ("output,o", boost::program_options::value<std::string>(), "output file");
+    ("config,c", boost::program_options::value<std::vector<std::string>>()->composing(), "config file (repeat with the same number of outputs to render variants)")
+    ("input,i", boost::program_options::value<std::string>(), "input file (- to read from stdin)")
+    ("output,o", boost::program_options::value<std::vector<std::string>>()->composing(), "output file (.flac and .ogg are compressed)")
+    ("parallel,p", "render each note as an independent job in parallel")
+    ("segment,s", boost::program_options::value<double>(), "render the song in segments of this many seconds in parallel")
+    ("fast-segment", "with --segment, approximate the envelope and AGC before each segment (faster, not bit-exact)")
+    ("start", boost::program_options::value<double>(), "start playback at this many seconds without rendering the preceding part")
+    ("engine,e", boost::program_options::value<std::string>()->default_value( "fm" ), "rendering engine (fm or additive)")
+    ("cache", boost::program_options::value<std::string>(), "keep per-instrument stems in this directory and re-render only changed instruments")
+    ("live", boost::program_options::value<std::string>(), "render raw MIDI bytes from this FIFO or UNIX socket in real time")
+    ("block", boost::program_options::value<size_t>()->default_value( 64u ), "block size in samples for --live")
+    ("batch", boost::program_options::value<std::string>(), "render every SMF in this directory, or every \"input [output]\" line of this manifest, into the output directory")
+    ("jobs,j", boost::program_options::value<int>()->default_value( 0 ), "number of files rendered at once by --batch (0 to use all cores)")
+    ("format,f", boost::program_options::value<std::string>()->default_value( "pcm16" ), "output sample format (pcm16, pcm24 or float)")
+    ("dither", "add TPDF dither when writing pcm16 or pcm24")
+    ("extension", boost::program_options::value<std::string>()->default_value( ".wav" ), "extension of the files written by --batch (.wav, .flac or .ogg)");
   boost::program_options::variables_map params;
   boost::program_options::store( boost::program_options::parse_command_line( argc, argv, options ), params );
   boost::program_options::notify( params );
-  if( params.count("help") || !params.count("config")|| !params.count("input") || !params.count("output") ) { 
+  if( params.count("help") || !params.count("config")|| ( !params.count("input") && !params.count("live") && !params.count("batch") ) || !params.count("output") ) { 
     std::cout << options << std::endl;
     return 0;
   }
-  std::ifstream config_file( params["config"].as<std::string>() );
-  nlohmann::json config;
-  config_file >> config;
-  using inst_t = smfp::multi_instrument_t< smfp::variable_t< smfp::fm_2op_nofb_t > >;
+  const auto config_names = params["config"].as< std::vector< std::string > >();
+  const auto output_names = params["output"].as< std::vector< std::string > >();
+  if( config_names.size() != output_names.size() ) {
+    std::cerr << "the number of configs and outputs must match" << std::endl;
+    return 1;
+  }
+  using inst_t = smfp::multi_instrument_t< smfp::instrument_t >;
   using config_t = inst_t::config_type;
-  std::shared_ptr< config_t > config_p( new config_t( config ) );
-  smfp::multi_instrument_t< smfp::variable_t< smfp::fm_2op_nofb_t > > inst( config_p );
-  stamp::mapped_file f( params["input"].as< std::string >() );
-  auto [iter,header] = smfp::decode_smf_header( f.begin(), f.end() );
-  smfp::smf_tracks_t tracks( header, iter, f.end() );
+  std::vector< std::shared_ptr< config_t > > configs;
+  for( const auto &name: config_names ) {
+    std::ifstream config_file( name );
+    nlohmann::json config;
+    config_file >> config;
+    configs.emplace_back( new config_t( config ) );
+  }
+  const auto config_p = configs.front();
+  smfp::multi_instrument_t< smfp::instrument_t > inst( config_p );
+  auto unit_step = std::chrono::nanoseconds( 1000ul * 1000ul * 1000ul / 44100ul );
   std::vector< inst_t > handlers( 64, inst );
   smfp::midi_parser_t midip( handlers );
-  auto unit_step = std::chrono::nanoseconds( 1000ul * 1000ul * 1000ul / 44100ul );
   smfp::mixer_t mixer( unit_step );
   std::vector< float > buf( 441 );
-  smfp::wavesink sink( params["output"].as< std::string >().c_str(), 44100 );
-  uint64_t count = 0;
-  while( !tracks.end() ) {
-    mixer( handlers, buf.begin(), buf.end() );
-    sink( buf );
-    auto sleep = unit_step * 441;
-    count += sleep.count();
-    tracks( sleep, midip );
+  const auto format_name = params["format"].as< std::string >();
+  if( format_name != "pcm16" && format_name != "pcm24" && format_name != "float" ) {
+    std::cerr << "unknown format: " << format_name << std::endl;
+    return 1;
+  }
+  const auto format =
+    format_name == "pcm24" ? smfp::sample_format_t::pcm24 :
+    format_name == "float" ? smfp::sample_format_t::float32 :
+    smfp::sample_format_t::pcm16;
+  const bool dither = params.count( "dither" );
+  const auto engine = params["engine"].as< std::string >();
+  if( engine != "fm" && engine != "additive" ) {
+    std::cerr << "unknown engine: " << engine << std::endl;
+    return 1;
+  }
+  // 4オペレータの楽器は部分音を返さないので、鳴らさずにAGCだけを下げてしまう
+  if( engine == "additive" && !std::all_of( configs.begin(), configs.end(), []( const auto &c ) { return c->has_partials(); } ) ) {
+    std::cerr << "the additive engine can only render 2op and sine instruments" << std::endl;
+    return 1;
+  }
+  if( params.count( "fast-segment" ) && !params.count( "segment" ) ) {
+    std::cerr << "--fast-segment can only be used with --segment" << std::endl;
+    return 1;
+  }
+  if( engine == "additive" && ( params.count( "parallel" ) || params.count( "segment" ) || params.count( "cache" ) ) ) {
+    std::cerr << "the additive engine can only be used with sequential rendering" << std::endl;
+    return 1;
+  }
+  const auto play = [&]( auto &tracks, auto &handlers, auto &parser, smfp::mixer_t &mixer, smfp::wavesink &sink ) {
+    std::vector< float > buf( 441 );
+    smfp::controller_coalescer_t coalescer( parser );
+    if( engine == "additive" ) {
+      ifm::additive_synth_t additive( unit_step );
+      while( !tracks.end() ) {
+        additive( handlers, mixer, buf.size(), sink );
+        tracks( unit_step * buf.size(), coalescer );
+        coalescer.flush();
+      }
+      additive.finish( handlers, mixer, sink );
+      return;
+    }
+    while( !tracks.end() ) {
+      smfp::play_block( tracks, coalescer, unit_step, buf.size(), [&]( size_t from, size_t to ) {
+        mixer( handlers, std::next( buf.begin(), from ), std::next( buf.begin(), to ) );
+      } );
+      coalescer.flush();
+      sink( buf );
+    }
+  };
+  if( params.count( "batch" ) ) {
+    if( configs.size() > 1u || params.count( "input" ) || params.count( "live" ) || params.count( "parallel" ) || params.count( "segment" ) || params.count( "start" ) || params.count( "cache" ) ) {
+      std::cerr << "--batch can only be used with a single config and an output directory" << std::endl;
+      return 1;
+    }
+    const std::filesystem::path output_dir( output_names.front() );
+    const std::filesystem::path batch( params["batch"].as< std::string >() );
+    std::vector< std::pair< std::string, std::string > > files;
+    const auto default_output = [&]( const std::filesystem::path &input ) {
+      return ( output_dir / input.filename().replace_extension( params["extension"].as< std::string >() ) ).string();
+    };
+    if( std::filesystem::is_directory( batch ) ) {
+      for( const auto &entry: std::filesystem::directory_iterator( batch ) ) {
+        auto ext = entry.path().extension().string();
+        std::transform( ext.begin(), ext.end(), ext.begin(), []( unsigned char c ) { return char( std::tolower( c ) ); } );
+        if( entry.is_regular_file() && ( ext == ".mid" || ext == ".midi" || ext == ".smf" ) )
+          files.emplace_back( entry.path().string(), default_output( entry.path() ) );
+      }
+      std::sort( files.begin(), files.end() );
+    }
+    else {
+      std::ifstream manifest( batch );
+      if( !manifest ) {
+        std::cerr << "unable to open " << batch.string() << std::endl;
+        return 1;
+      }
+      std::string line;
+      while( std::getline( manifest, line ) ) {
+        std::istringstream fields( line );
+        std::string input, output;
+        if( !( fields >> input ) || input.front() == '#' ) continue;
+        // 相対パスの入力はmanifestの置かれたディレクトリから辿る
+        if( std::filesystem::path( input ).is_relative() ) input = ( batch.parent_path() / input ).string();
+        if( !( fields >> output ) ) output = default_output( input );
+        else if( std::filesystem::path( output ).is_relative() ) output = ( output_dir / output ).string();
+        files.emplace_back( input, output );
+      }
+    }
+    std::filesystem::create_directories( output_dir );
+    // バンクは全てのファイルで共有し、パーサとボイスはファイル毎に作る
+    // 同時に持つのは実行中のファイルの分だけなので、メモリはファイル数ではなくスレッド数で決まる
+    const auto jobs = params["jobs"].as< int >();
+    const auto batch_begin = std::chrono::steady_clock::now();
+    double total_length = 0.0;
+    size_t failed = 0u;
+#pragma omp parallel for schedule( dynamic ) num_threads( jobs > 0 ? jobs : omp_get_max_threads() ) reduction( +:total_length,failed )
+    for( size_t i = 0; i < files.size(); ++i ) {
+      const auto begin = std::chrono::steady_clock::now();
+      std::ostringstream message;
+      try {
+        stamp::mapped_file file( files[ i ].first );
+        auto [iter,header] = smfp::decode_smf_header( file.begin(), file.end() );
+        const smfp::smf_timeline_t timeline( header, iter, file.end(), unit_step );
+        smfp::smf_timeline_player_t tracks( timeline );
+        std::vector< inst_t > file_handlers( 64, inst_t( config_p ) );
+        smfp::midi_parser_t parser( file_handlers );
+        smfp::mixer_t file_mixer( unit_step );
+        {
+          smfp::wavesink sink( files[ i ].second.c_str(), 44100, format, dither );
+          play( tracks, file_handlers, parser, file_mixer, sink );
+          sink.close();
+        }
+        const double length = timeline.empty() ? 0.0 : timeline.time.back() / 44100.0;
+        const double elapsed = std::chrono::duration< double >( std::chrono::steady_clock::now() - begin ).count();
+        total_length += length;
+        message << files[ i ].first << " -> " << files[ i ].second << ": " << length << " s in " << elapsed << " s (" << length / elapsed << "x realtime)";
+      }
+      catch( const std::exception &e ) {
+        ++failed;
+        message << files[ i ].first << ": " << e.what();
+      }
+#pragma omp critical
+      std::cout << message.str() << std::endl;
+    }
+    const double elapsed = std::chrono::duration< double >( std::chrono::steady_clock::now() - batch_begin ).count();
+    std::cout << files.size() - failed << " / " << files.size() << " files, " << total_length << " s in " << elapsed << " s (" << total_length / elapsed << "x realtime, " << ( files.size() - failed ) / elapsed << " files/s)" << std::endl;
+    return failed ? 1 : 0;
+  }
+  if( params.count( "live" ) ) {
+    const auto block_size = params["block"].as< size_t >();
+    if( configs.size() > 1u || engine != "fm" || block_size == 0u ) {
+      std::cerr << "--live can only be used with a single config, the fm engine and a non-zero block size" << std::endl;
+      return 1;
+    }
+    smfp::live_input_t input( params["live"].as< std::string >() );
+    smfp::wavesink sink( output_names.front().c_str(), 44100, format, dither );
+    smfp::play_live( input, midip, handlers, mixer, sink, unit_step, block_size );
+    sink.close();
+    return 0;
+  }
+  const auto input_name = params["input"].as< std::string >();
+  const bool sequential = configs.size() == 1u && !params.count( "parallel" ) && !params.count( "segment" ) && !params.count( "cache" ) && !params.count( "start" );
+  if( input_name == "-" && sequential ) {
+    // 1トラックなら読みながら再生し、複数トラックなら全てのトラックが届いてから再生する
+    const auto header = smfp::read_smf_header( std::cin );
+    smfp::wavesink sink( output_names.front().c_str(), 44100, format, dither );
+    if( header.ntrks <= 1u ) {
+      smfp::smf_stream_player_t tracks( std::cin, header, unit_step );
+      play( tracks, handlers, midip, mixer, sink );
+    }
+    else {
+      const auto data = smfp::read_stream( std::cin );
+      const smfp::smf_timeline_t timeline( header, data.begin(), data.end(), unit_step );
+      smfp::smf_timeline_player_t tracks( timeline );
+      play( tracks, handlers, midip, mixer, sink );
+    }
+    sink.close();
+    return 0;
+  }
+  std::optional< stamp::mapped_file > mapped;
+  std::vector< uint8_t > piped;
+  if( input_name == "-" ) piped = smfp::read_stream( std::cin );
+  else mapped.emplace( input_name );
+  const uint8_t *input_begin = mapped ? mapped->begin() : piped.data();
+  const uint8_t *input_end = mapped ? mapped->end() : std::next( piped.data(), piped.size() );
+  auto [iter,header] = smfp::decode_smf_header( input_begin, input_end );
+  const smfp::smf_timeline_t timeline( header, iter, input_end, unit_step );
+  smfp::smf_timeline_player_t tracks( timeline );
+  if( params.count( "start" ) ) {
+    if( configs.size() > 1u || params.count( "parallel" ) || params.count( "segment" ) || params.count( "cache" ) ) {
+      std::cerr << "--start can only be used with sequential rendering" << std::endl;
+      return 1;
+    }
+    const auto samples = uint64_t( std::round( std::max( params["start"].as< double >(), 0.0 ) * 44100.0 ) );
+    smfp::seek( tracks, midip, handlers, mixer, unit_step, buf.size(), samples );
+  }
+  if( configs.size() > 1u ) {
+    if( engine != "fm" || params.count( "parallel" ) || params.count( "segment" ) || params.count( "cache" ) ) {
+      std::cerr << "multiple configs can only be rendered with the fm engine and without --parallel, --segment or --cache" << std::endl;
+      return 1;
+    }
+    // スロットの割り当ては音色に依存しないので、1回記録したイベント列を全ての音色で描画する
+    const auto jobs = smfp::record_voice_jobs( tracks, handlers.size(), unit_step, buf.size() );
+    size_t failed = 0u;
+#pragma omp parallel for schedule( dynamic ) reduction( +:failed )
+    for( size_t i = 0; i < configs.size(); ++i ) {
+      try {
+        smfp::mixer_t variant_mixer( unit_step );
+        smfp::wavesink variant_sink( output_names[ i ].c_str(), 44100, format, dither );
+        smfp::render_voice_jobs( jobs, inst_t( configs[ i ] ), unit_step, variant_mixer, variant_sink );
+        variant_sink.close();
+      }
+      catch( const std::exception &e ) {
+        ++failed;
+#pragma omp critical
+        std::cerr << output_names[ i ] << ": " << e.what() << std::endl;
+      }
+    }
+    return failed ? 1 : 0;
+  }
+  smfp::wavesink sink( output_names.front().c_str(), 44100, format, dither );
+  if( engine == "additive" ) {
+    play( tracks, handlers, midip, mixer, sink );
+    sink.close();
+    return 0;
+  }
+  if( params.count( "cache" ) ) {
+    const auto jobs = smfp::record_voice_jobs( tracks, handlers.size(), unit_step, buf.size() );
+    auto context = smfp::fnv1a( input_begin, std::distance( input_begin, input_end ) );
+    const auto step_count = unit_step.count();
+    context = smfp::fnv1a( &step_count, sizeof( step_count ), context );
+    const auto [rendered,total] = smfp::render_voice_jobs_incremental(
+      jobs, inst, unit_step, mixer, sink, params["cache"].as< std::string >(), context,
+      [&]( const smfp::voice_job_t &job ) {
+        return config_p->get( jobs.states[ job.events.front().state ] )->dump().dump();
+      }
+    );
+    sink.close();
+    std::cout << rendered << " / " << total << " stems rendered" << std::endl;
+    return 0;
+  }
+  if( params.count( "segment" ) ) {
+    const auto seconds = params["segment"].as< double >();
+    if( seconds <= 0.0 ) {
+      std::cerr << "segment length must be positive" << std::endl;
+      return 1;
+    }
+    const auto segment_size = std::max( size_t( seconds * 44100.0 / buf.size() ), size_t( 1u ) );
+    smfp::render_segments( tracks, handlers, unit_step, buf.size(), segment_size, mixer, sink, params.count( "fast-segment" ) );
+    sink.close();
+    return 0;
+  }
+  if( params.count( "parallel" ) ) {
+    smfp::render_voice_jobs( smfp::record_voice_jobs( tracks, handlers.size(), unit_step, buf.size() ), inst, unit_step, mixer, sink );
+    sink.close();
+    return 0;
   }
+  play( tracks, handlers, midip, mixer, sink );
+  sink.close();
 }
 
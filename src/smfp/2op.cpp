@@ -2,6 +2,29 @@
 #include <smfp/get_volume.hpp>
 
 namespace smfp {
+  namespace {
+    constexpr size_t max_cycle_length = 8192u;
+    constexpr unsigned int max_ratio_denominator = 16u;
+    // 周期の継ぎ目で許容するずれ(サンプル)
+    constexpr float cycle_tolerance = 0.01f;
+    bool is_near_integer( float value, float tolerance ) {
+      return std::abs( value - std::round( value ) ) < tolerance;
+    }
+  }
+  std::string to_string( fm_2op_nofb_kernel_t v ) {
+    if( v == fm_2op_nofb_kernel_t::full ) return "full";
+    else if( v == fm_2op_nofb_kernel_t::constant_modulator ) return "constant_modulator";
+    else if( v == fm_2op_nofb_kernel_t::carrier_only ) return "carrier_only";
+    else if( v == fm_2op_nofb_kernel_t::silent ) return "silent";
+    else return "unknown";
+  }
+  fm_2op_nofb_kernel_t get_kernel( const fm_2op_nofb_config_t &config ) {
+    if( is_silent( config.lower.eg ) ) return fm_2op_nofb_kernel_t::silent;
+    if( config.lower.fm.modulation[ 0 ] == 0.f || is_silent( config.upper.eg ) )
+      return fm_2op_nofb_kernel_t::carrier_only;
+    if( is_sustain_only( config.upper.eg ) ) return fm_2op_nofb_kernel_t::constant_modulator;
+    return fm_2op_nofb_kernel_t::full;
+  }
   fm_2op_nofb_config_t::fm_2op_nofb_config_t( const nlohmann::json &config ) :
     lower( get_node( config, "lower" ) ),
     upper( get_node( config, "upper" ) ) {}
@@ -22,50 +45,216 @@ namespace smfp {
   }
   fm_2op_nofb_t::fm_2op_nofb_t( const fm_2op_nofb_config_t &config ) :
     lower( config.lower ),
-    upper( config.upper ) {}
+    upper( config.upper ),
+    kernel( get_kernel( config ) ),
+    cycle_state( fm_2op_nofb_cycle_state_t::idle ),
+    cycle_pos( 0u ),
+    cycle_envelope( 0.f ),
+    cycle_step( 0 ),
+    cycle_lower( config.lower.fm ),
+    cycle_upper( config.upper.fm ) {}
   fm_2op_nofb_t::fm_2op_nofb_t( const nlohmann::json &config ) :
     fm_2op_nofb_t( fm_2op_nofb_config_t( config ) ) {}
   nlohmann::json fm_2op_nofb_t::dump() const {
     return {
       { "lower", lower.dump() },
-      { "upper", upper.dump() }
+      { "upper", upper.dump() },
+      { "kernel", to_string( kernel ) }
     };
   }
   void fm_2op_nofb_t::set_config( const channel_state_t &cst, const fm_2op_nofb_config_t &config ) {
+    end_cycle();
     lower.set_config( cst, config.lower );
     upper.set_config( cst, config.upper );
+    kernel = get_kernel( config );
+    update_modulator_gain();
   }
   void fm_2op_nofb_t::note_on( const channel_state_t &cst, const active_note_t &nst ) {
+    end_cycle();
     if( ( nst.channel_note >> 8 ) == 10 ) return;
     lower.note_on( cst, nst );
     upper.note_on( cst, nst );
     upper.set_volume( cst, 0.f );
     lower.set_volume( cst, get_volume( cst, nst ) );
+    update_modulator_gain();
   }
   void fm_2op_nofb_t::note_off( const channel_state_t &cst ) {
+    end_cycle();
     lower.note_off( cst );
     upper.note_off( cst );
   }
   void fm_2op_nofb_t::clear( const channel_state_t &cst ) {
+    end_cycle();
     lower.clear( cst );
     upper.clear( cst );
   }
   void fm_2op_nofb_t::set_frequency( const channel_state_t &cst, float freq ) {
+    end_cycle();
     lower.set_frequency( cst, freq );
     upper.set_frequency( cst, freq );
   }
   std::tuple< float, float > fm_2op_nofb_t::operator()( std::chrono::nanoseconds step ) {
+    if( cycle_state == fm_2op_nofb_cycle_state_t::playing ) {
+      const auto value = cycle[ cycle_pos++ ];
+      if( cycle_pos == cycle.size() ) cycle_pos = 0u;
+      return std::make_tuple( cycle_envelope, value );
+    }
+    if( cycle_state == fm_2op_nofb_cycle_state_t::idle && lower.eg.is_sustain() ) begin_cycle( step );
+    const auto result = render( step );
+    if( cycle_state == fm_2op_nofb_cycle_state_t::recording ) record_cycle( result );
+    return result;
+  }
+  std::tuple< float, float > fm_2op_nofb_t::render( std::chrono::nanoseconds step ) {
     const float top = 0.f;
-    auto [uenv,uval] = upper( step, &top );
-    return lower( step, &uval );
+    if( kernel == fm_2op_nofb_kernel_t::constant_modulator && upper.eg.is_sustain() ) {
+      // ゲインはupdate_modulator_gainで求めてあるのでエンベロープを計算しない
+      const float uval = upper.gain * upper.fm( step, &top );
+      return lower( step, &uval );
+    }
+    if( has_modulator() ) {
+      auto [uenv,uval] = upper( step, &top );
+      return lower( step, &uval );
+    }
+    else if( kernel == fm_2op_nofb_kernel_t::carrier_only )
+      return lower( step, &top );
+    else
+      return std::make_tuple( -std::numeric_limits< float >::infinity(), 0.f );
+  }
+  std::tuple< float, float > fm_2op_nofb_t::advance( std::chrono::nanoseconds step ) {
+    if( cycle_state != fm_2op_nofb_cycle_state_t::idle ) end_cycle();
+    return advance_operators( step );
+  }
+  // 記録した周期を繰り返している間は位相を進めずに描画しているので、周期の状態も描画と同じように進める
+  std::tuple< float, float > fm_2op_nofb_t::trace( std::chrono::nanoseconds step ) {
+    if( cycle_state == fm_2op_nofb_cycle_state_t::playing ) {
+      if( ++cycle_pos == cycle.size() ) cycle_pos = 0u;
+      return std::make_tuple( cycle_envelope, std::pow( 10.f, cycle_envelope / 40.f ) );
+    }
+    if( cycle_state == fm_2op_nofb_cycle_state_t::recording || ( cycle_state == fm_2op_nofb_cycle_state_t::idle && lower.eg.is_sustain() ) ) {
+      // 周期の記録には波形が要る
+      const auto envelope = std::get< 0 >( (*this)( step ) );
+      return std::make_tuple( envelope, std::pow( 10.f, envelope / 40.f ) );
+    }
+    return advance_operators( step );
+  }
+  std::tuple< float, float > fm_2op_nofb_t::advance( std::chrono::nanoseconds step, uint64_t count ) {
+    if( cycle_state != fm_2op_nofb_cycle_state_t::idle ) end_cycle();
+    if( has_modulator() ) {
+      upper.advance( step, count );
+      return lower.advance( step, count );
+    }
+    else if( kernel == fm_2op_nofb_kernel_t::carrier_only )
+      return lower.advance( step, count );
+    else
+      return std::make_tuple( -std::numeric_limits< float >::infinity(), 0.f );
+  }
+  std::tuple< float, float > fm_2op_nofb_t::skip( std::chrono::nanoseconds step, uint64_t count ) {
+    end_cycle();
+    if( has_modulator() ) {
+      upper.skip( step, count );
+      return lower.skip( step, count );
+    }
+    else if( kernel == fm_2op_nofb_kernel_t::carrier_only )
+      return lower.skip( step, count );
+    else
+      return std::make_tuple( -std::numeric_limits< float >::infinity(), 0.f );
+  }
+  fm_2op_nofb_partials_t fm_2op_nofb_t::get_partials() const {
+    fm_2op_nofb_partials_t partials;
+    partials.gain = ( kernel == fm_2op_nofb_kernel_t::silent ) ? 0.f : lower.gain;
+    partials.carrier_phase = lower.fm.get_phase();
+    partials.carrier_frequency = lower.fm.get_tangent();
+    partials.modulator_phase = upper.fm.get_phase();
+    partials.modulator_frequency = upper.fm.get_tangent();
+    partials.index = has_modulator() ?
+      2.f * float( M_PI ) * lower.fm.get_config().modulation[ 0 ] * upper.gain :
+      0.f;
+    return partials;
+  }
+  void fm_2op_nofb_t::begin_cycle( std::chrono::nanoseconds step ) {
+    if( kernel == fm_2op_nofb_kernel_t::silent ) {
+      cycle_state = fm_2op_nofb_cycle_state_t::disabled;
+      return;
+    }
+    if( has_modulator() && !upper.eg.is_sustain() ) return;
+    // 記録中に位相の巻き戻しが起きないようにする
+    const float dt = std::chrono::duration_cast< std::chrono::duration< float > >( step ).count();
+    if( lower.fm.get_time() + dt * max_cycle_length >= 1.f ) return;
+    if( has_modulator() ) {
+      if( upper.fm.get_time() + dt * max_cycle_length >= 1.f ) return;
+      // キャリアとモジュレータの周波数比が有理数でなければ周期的にならない
+      const float ratio = upper.fm.get_tangent() / lower.fm.get_tangent();
+      bool rational = false;
+      for( unsigned int q = 1u; q <= max_ratio_denominator && !rational; ++q )
+        rational = is_near_integer( ratio * q, 1.e-4f );
+      if( !rational ) {
+        cycle_state = fm_2op_nofb_cycle_state_t::disabled;
+        return;
+      }
+    }
+    cycle_lower = lower.fm;
+    cycle_upper = upper.fm;
+    cycle_step = step;
+    cycle.clear();
+    cycle.reserve( max_cycle_length );
+    cycle_state = fm_2op_nofb_cycle_state_t::recording;
+  }
+  void fm_2op_nofb_t::record_cycle( const std::tuple< float, float > &value ) {
+    cycle.push_back( std::get< 1 >( value ) );
+    cycle_envelope = std::get< 0 >( value );
+    const float dt = std::chrono::duration_cast< std::chrono::duration< float > >( cycle_step ).count();
+    const auto returned = [&]( const auto &current, const auto &begin ) {
+      const float tangent = current.get_tangent();
+      return is_near_integer( tangent * ( current.get_time() - begin.get_time() ), tangent * dt * cycle_tolerance );
+    };
+    if( returned( lower.fm, cycle_lower ) && ( !has_modulator() || returned( upper.fm, cycle_upper ) ) ) {
+      cycle_pos = 0u;
+      cycle_state = fm_2op_nofb_cycle_state_t::playing;
+    }
+    else if( cycle.size() == max_cycle_length ) {
+      cycle.clear();
+      cycle_state = fm_2op_nofb_cycle_state_t::disabled;
+    }
+  }
+  void fm_2op_nofb_t::end_cycle() {
+    // 繰り返しを止めた時点の位相から続きを計算できるようにする
+    if( cycle_state == fm_2op_nofb_cycle_state_t::playing ) {
+      lower.fm = cycle_lower;
+      upper.fm = cycle_upper;
+      for( size_t i = 0u; i != cycle_pos; ++i ) {
+        lower.fm.advance( cycle_step );
+        if( has_modulator() ) upper.fm.advance( cycle_step );
+      }
+    }
+    cycle.clear();
+    cycle_state = fm_2op_nofb_cycle_state_t::idle;
   }
   void fm_2op_nofb_t::set_variable( channel_variable_id_t /*id*/, note_t /*at*/, const channel_state_t &/*cst*/ ) {
   }
   void fm_2op_nofb_t::set_program( const channel_state_t&,  uint8_t ) {
   }
   void fm_2op_nofb_t::set_volume( const channel_state_t &cst, float value ) {
+    end_cycle();
     lower.set_volume( cst, value );
   }
+  std::tuple< float, float > fm_2op_nofb_t::advance_operators( std::chrono::nanoseconds step ) {
+    if( has_modulator() ) {
+      upper.advance( step );
+      return lower.advance( step );
+    }
+    else if( kernel == fm_2op_nofb_kernel_t::carrier_only )
+      return lower.advance( step );
+    else
+      return std::make_tuple( -std::numeric_limits< float >::infinity(), 0.f );
+  }
+  bool fm_2op_nofb_t::has_modulator() const {
+    return kernel == fm_2op_nofb_kernel_t::full || kernel == fm_2op_nofb_kernel_t::constant_modulator;
+  }
+  // サステインのレベルは時間に依存しないので、発音の始めに1回だけゲインを求める
+  void fm_2op_nofb_t::update_modulator_gain() {
+    if( kernel == fm_2op_nofb_kernel_t::constant_modulator && upper.eg.is_sustain() )
+      upper.set_envelope( upper.eg( std::chrono::nanoseconds( 0 ) ) );
+  }
   bool fm_2op_nofb_t::is_end() const {
     return lower.is_end();
   }
@@ -1,3 +1,6 @@
+#include <cmath>
+#include <limits>
+#include <numeric>
 #include <smfp/channel_state.hpp>
 
 namespace smfp {
@@ -72,77 +75,150 @@ namespace smfp {
     else return "unknown";
   }
   channel_state_t::channel_state_t( const global_state_t *gst ) : global_state( gst ), program( 0 ), pitch_bend( 0 ), pressure( 0x7F ) {
-    control[ int( channel_variable_id_t::bank ) ] = 0u;
-    control[ int( channel_variable_id_t::modulation ) ] = 0u;
-    control[ int( channel_variable_id_t::breath ) ] = 0x3FFFu;
-    control[ int( channel_variable_id_t::foot ) ] = 0x3FFFu;
-    control[ int( channel_variable_id_t::portamento_time ) ] = 0u;
-    control[ int( channel_variable_id_t::data_entry ) ] = 0xC000u;
-    control[ int( channel_variable_id_t::volume ) ] = 0x2800u;
-    control[ int( channel_variable_id_t::balance ) ] = 0u;
-    control[ int( channel_variable_id_t::pan ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::expression ) ] = 0x3FFFu;
-    control[ int( channel_variable_id_t::effect1 ) ] = 0u;
-    control[ int( channel_variable_id_t::effect2 ) ] = 0u;
-    control[ int( channel_variable_id_t::reverb ) ] = 0u;
-    control[ int( channel_variable_id_t::tremolo ) ] = 0u;
-    control[ int( channel_variable_id_t::chorus ) ] = 0u;
-    control[ int( channel_variable_id_t::celeste ) ] = 0u;
-    control[ int( channel_variable_id_t::phaser ) ] = 0u;
-    control[ int( channel_variable_id_t::general_purpose1 ) ] = 0u;
-    control[ int( channel_variable_id_t::general_purpose2 ) ] = 0u;
-    control[ int( channel_variable_id_t::general_purpose3 ) ] = 0u;
-    control[ int( channel_variable_id_t::general_purpose4 ) ] = 0u;
-    control[ int( channel_variable_id_t::general_purpose5 ) ] = 0u;
-    control[ int( channel_variable_id_t::general_purpose6 ) ] = 0u;
-    control[ int( channel_variable_id_t::general_purpose7 ) ] = 0u;
-    control[ int( channel_variable_id_t::general_purpose8 ) ] = 0u;
-    control[ int( channel_variable_id_t::hold1 ) ] = 0u;
-    control[ int( channel_variable_id_t::sostenuto ) ] = 0u;
-    control[ int( channel_variable_id_t::soft ) ] = 0u;
-    control[ int( channel_variable_id_t::legato ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::hold2 ) ] = 0u;
-    control[ int( channel_variable_id_t::variation ) ] = 0u;
-    control[ int( channel_variable_id_t::timbre ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::release ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::attack ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::brightness ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::decay ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::vibrato_rate ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::vibrato_depth ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::vibrato_delay ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::nrpn ) ] = 0xFFFFu;
-    control[ int( channel_variable_id_t::rpn ) ] = 0xFFFFu;
-    control[ int( channel_variable_id_t::pitch_bend_sensitivity ) ] = ( 2 << 7 );
-    control[ int( channel_variable_id_t::master_fine_tune ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::master_coarse_tune ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::modulation_depth_range ) ] = 0u;
-    control[ int( channel_variable_id_t::vibrato_rate_gs ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::vibrato_depth_gs ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::vibrato_delay_gs ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::vibrato_rate_xg ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::vibrato_depth_xg ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::vibrato_delay_xg ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::tvf_cutoff_freq ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::tvf_resonance ) ] = 0x2000u; ///
-     control[ int( channel_variable_id_t::hpf_cutoff_freq ) ] = 0x2000u;
-     control[ int( channel_variable_id_t::hpf_resonance ) ] = 0x2000u;
-     control[ int( channel_variable_id_t::eq_bass ) ] = 0x2000u;
-     control[ int( channel_variable_id_t::eq_treble ) ] = 0x2000u;
-     control[ int( channel_variable_id_t::eq_mid_bass ) ] = 0x2000u;
-     control[ int( channel_variable_id_t::eq_mid_treble ) ] = 0x2000u;
-     control[ int( channel_variable_id_t::eq_bass_frequency ) ] = 0x2000u;
-     control[ int( channel_variable_id_t::eq_treble_frequency ) ] = 0x2000u;
-     control[ int( channel_variable_id_t::eq_mid_bass_frequency ) ] = 0x2000u;
-     control[ int( channel_variable_id_t::eq_mid_treble_frequency ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::tvf_tva_envelope_attack_time ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::tvf_tva_envelope_decay_time ) ] = 0x2000u;
-    control[ int( channel_variable_id_t::tvf_tva_envelope_release_time ) ] = 0x2000u;
-    std::fill( control.data() + int( channel_variable_id_t::drum_pitch ), control.data() + int( channel_variable_id_t::drum_pitch ) + 128, 0x2000u );
-    std::fill( control.data() + int( channel_variable_id_t::drum_tva ), control.data() + int( channel_variable_id_t::drum_tva ) + 128, 0u );
-    std::fill( control.data() + int( channel_variable_id_t::drum_pan ), control.data() + int( channel_variable_id_t::drum_pan ) + 128, 0x2000u );
-    std::fill( control.data() + int( channel_variable_id_t::drum_reverb ), control.data() + int( channel_variable_id_t::drum_reverb ) + 128, 0u );
-    std::fill( control.data() + int( channel_variable_id_t::drum_chorus ), control.data() + int( channel_variable_id_t::drum_chorus ) + 128, 0u );
+    control[ get_control_index( channel_variable_id_t::bank ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::modulation ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::breath ) ] = 0x3FFFu;
+    control[ get_control_index( channel_variable_id_t::foot ) ] = 0x3FFFu;
+    control[ get_control_index( channel_variable_id_t::portamento_time ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::data_entry ) ] = 0xC000u;
+    control[ get_control_index( channel_variable_id_t::volume ) ] = 0x2800u;
+    control[ get_control_index( channel_variable_id_t::balance ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::pan ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::expression ) ] = 0x3FFFu;
+    control[ get_control_index( channel_variable_id_t::effect1 ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::effect2 ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::reverb ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::tremolo ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::chorus ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::celeste ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::phaser ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::general_purpose1 ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::general_purpose2 ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::general_purpose3 ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::general_purpose4 ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::general_purpose5 ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::general_purpose6 ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::general_purpose7 ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::general_purpose8 ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::hold1 ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::sostenuto ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::soft ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::legato ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::hold2 ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::variation ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::timbre ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::release ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::attack ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::brightness ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::decay ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::vibrato_rate ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::vibrato_depth ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::vibrato_delay ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::nrpn ) ] = 0xFFFFu;
+    control[ get_control_index( channel_variable_id_t::rpn ) ] = 0xFFFFu;
+    control[ get_control_index( channel_variable_id_t::pitch_bend_sensitivity ) ] = ( 2 << 7 );
+    control[ get_control_index( channel_variable_id_t::master_fine_tune ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::master_coarse_tune ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::modulation_depth_range ) ] = 0u;
+    control[ get_control_index( channel_variable_id_t::vibrato_rate_gs ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::vibrato_depth_gs ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::vibrato_delay_gs ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::vibrato_rate_xg ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::vibrato_depth_xg ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::vibrato_delay_xg ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::tvf_cutoff_freq ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::tvf_resonance ) ] = 0x2000u; ///
+     control[ get_control_index( channel_variable_id_t::hpf_cutoff_freq ) ] = 0x2000u;
+     control[ get_control_index( channel_variable_id_t::hpf_resonance ) ] = 0x2000u;
+     control[ get_control_index( channel_variable_id_t::eq_bass ) ] = 0x2000u;
+     control[ get_control_index( channel_variable_id_t::eq_treble ) ] = 0x2000u;
+     control[ get_control_index( channel_variable_id_t::eq_mid_bass ) ] = 0x2000u;
+     control[ get_control_index( channel_variable_id_t::eq_mid_treble ) ] = 0x2000u;
+     control[ get_control_index( channel_variable_id_t::eq_bass_frequency ) ] = 0x2000u;
+     control[ get_control_index( channel_variable_id_t::eq_treble_frequency ) ] = 0x2000u;
+     control[ get_control_index( channel_variable_id_t::eq_mid_bass_frequency ) ] = 0x2000u;
+     control[ get_control_index( channel_variable_id_t::eq_mid_treble_frequency ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::tvf_tva_envelope_attack_time ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::tvf_tva_envelope_decay_time ) ] = 0x2000u;
+    control[ get_control_index( channel_variable_id_t::tvf_tva_envelope_release_time ) ] = 0x2000u;
+    update_volume();
+    update_pitch_bend();
+    update_envelope();
+  }
+  channel_state_t &channel_state_t::set_pitch_bend( pitch_t value ) {
+    pitch_bend = value;
+    update_pitch_bend();
+    return *this;
+  }
+  channel_state_t &channel_state_t::set_pressure( uint8_t value ) {
+    pressure = value;
+    update_volume();
+    return *this;
+  }
+  void channel_state_t::update( channel_variable_id_t id ) {
+    if(
+      id == channel_variable_id_t::volume ||
+      id == channel_variable_id_t::expression ||
+      id == channel_variable_id_t::foot ||
+      id == channel_variable_id_t::breath ||
+      id == channel_variable_id_t::soft
+    ) update_volume();
+    else if(
+      id == channel_variable_id_t::pitch_bend_sensitivity ||
+      id == channel_variable_id_t::master_fine_tune ||
+      id == channel_variable_id_t::master_coarse_tune
+    ) update_pitch_bend();
+    else if(
+      id == channel_variable_id_t::tvf_tva_envelope_attack_time ||
+      id == channel_variable_id_t::tvf_tva_envelope_decay_time ||
+      id == channel_variable_id_t::tvf_tva_envelope_release_time
+    ) update_envelope();
+  }
+  void channel_state_t::update_volume() {
+    const std::array< float, 6u > values{
+      control[ get_control_index( channel_variable_id_t::volume ) ] / float( 0x3FFF ),
+      control[ get_control_index( channel_variable_id_t::expression ) ] / float( 0x3FFF ),
+      control[ get_control_index( channel_variable_id_t::foot ) ] / float( 0x3FFF ),
+      control[ get_control_index( channel_variable_id_t::breath ) ] / float( 0x3FFF ),
+      pressure / float( 0x7F ),
+      ( ( control[ get_control_index( channel_variable_id_t::soft ) ] >> 7 ) + 0x100u ) / float( 0x17Fu )
+    };
+    if( std::find( values.begin(), values.end(), 0.f ) != values.end() ) {
+      volume = -std::numeric_limits< float >::infinity();
+      return;
+    }
+    volume = std::accumulate( values.begin(), values.end(), 0.f, []( auto sum, auto v ) {
+      return sum + 40 * std::log10( v );
+    } );
+  }
+  void channel_state_t::update_pitch_bend() {
+    pitch_bend_semitones = float( pitch_bend ) / 8192.f * get< channel_variable_id_t::pitch_bend_sensitivity >();
+    pitch_ratio = std::exp2f( ( pitch_bend_semitones + get< channel_variable_id_t::master_fine_tune >() ) / 12.f );
+  }
+  void channel_state_t::update_envelope() {
+    attack_time_scale = get< channel_variable_id_t::tvf_tva_envelope_attack_time >() + 1.f;
+    decay_time_scale = get< channel_variable_id_t::tvf_tva_envelope_decay_time >() + 1.f;
+    release_time_scale = get< channel_variable_id_t::tvf_tva_envelope_release_time >() + 1.f;
+  }
+  const drum_state_t channel_state_t::default_drum = [] {
+    drum_state_t drum;
+    const auto offset = [&]( channel_variable_id_t id ) {
+      return std::next( drum.begin(), int( id ) - int( channel_variable_id_t::drum_pitch ) );
+    };
+    std::fill( offset( channel_variable_id_t::drum_pitch ), offset( channel_variable_id_t::drum_pan ), 0x2000u );
+    std::fill( offset( channel_variable_id_t::drum_pan ), offset( channel_variable_id_t::drum_tva ), 0x2000u );
+    std::fill( offset( channel_variable_id_t::drum_tva ), drum.end(), 0u );
+    return drum;
+  }();
+  drum_state_t &channel_state_t::get_drum() {
+    if( !drum ) drum.reset( new drum_state_t( default_drum ) );
+    else if( drum.use_count() != 1 ) drum.reset( new drum_state_t( *drum ) );
+    return *drum;
+  }
+  bool channel_state_t::operator==( const channel_state_t &r ) const {
+    if( global_state != r.global_state || program != r.program || pitch_bend != r.pitch_bend || pressure != r.pressure || control != r.control ) return false;
+    if( drum == r.drum ) return true;
+    return ( drum ? *drum : default_drum ) == ( r.drum ? *r.drum : default_drum );
   }
   nlohmann::json channel_state_t::to_json() const {
     nlohmann::json root = nlohmann::json::object();
@@ -206,8 +282,5 @@ namespace smfp {
     if( get< channel_variable_id_t::tvf_tva_envelope_release_time >() != 0 ) root[ "tvf_tva_envelope_release_time" ] = get< channel_variable_id_t::tvf_tva_envelope_release_time >();
     return root;
   }
-  float channel_state_t::get_pitch_bend() const {
-    return float( pitch_bend ) / 8192.f * get< channel_variable_id_t::pitch_bend_sensitivity >();
-  }
 }
 
@@ -5,27 +5,36 @@
 
 namespace smfp {
   void dummy_handler::note_on( const channel_state_t &cst, const active_note_t &nst ) {
+    note_info = nst;
+    if( quiet ) return;
     std::cout << "note_on " << int( nst.channel_note & 0xFF ) << " " << int( cst.program ) << " " << get_frequency( cst, nst ) << " " << get_volume( cst, nst ) << std::endl;
     std::cout << "  " << cst.to_json().dump() << std::endl;
-    note_info = nst;
   }
   void dummy_handler::clear( const channel_state_t & ) {
+    if( quiet ) return;
     std::cout << "clear " << int( note_info.channel_note & 0xFF ) << std::endl;
   }
   void dummy_handler::note_off( const channel_state_t & ) {
+    if( quiet ) return;
     std::cout << "note_off " << int( note_info.channel_note & 0xFF ) << std::endl;
   }
   void dummy_handler::set_program( const channel_state_t&,  uint8_t value ) {
+    if( quiet ) return;
     std::cout << "set_program " << int( value ) << std::endl;
   }
   void dummy_handler::set_variable( channel_variable_id_t id, note_t at, const channel_state_t &cst ) {
+    if( quiet ) return;
     std::cout << "set_variable " << int( id ) << "[" << int( at ) << "] = " << cst[ id ] << std::endl;
   }
   void dummy_handler::set_volume( const channel_state_t &, float value ) {
+    if( quiet ) return;
     std::cout << "set_volume " << value << std::endl;
   }
   void dummy_handler::set_frequency( const channel_state_t &, float value ) {
+    if( quiet ) return;
     std::cout << "set_frequency " << value << std::endl;
   }
+  std::tuple< float, float > dummy_handler::skip( std::chrono::nanoseconds, uint64_t ) {
+    return std::make_tuple( -std::numeric_limits< float >::infinity(), 0.f );
+  }
 }
-
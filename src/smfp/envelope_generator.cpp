@@ -60,6 +60,23 @@ namespace smfp {
       .set_sustain( std::lerp( l.sustain, r.sustain, pos ) )
       .set_default_release( std::lerp( l.default_release, r.default_release, pos ) );
   }
+  namespace {
+    bool has_no_transition( const envelope_generator_config_t &config ) {
+      return
+        config.delay == 0 &&
+        config.default_attack1 == 0 &&
+        config.default_attack2 == 0 &&
+        config.hold == 0 &&
+        config.default_decay1 == 0 &&
+        config.default_decay2 == 0;
+    }
+  }
+  bool is_silent( const envelope_generator_config_t &config ) {
+    return has_no_transition( config ) && config.sustain <= envelope_generator_t::lowest;
+  }
+  bool is_sustain_only( const envelope_generator_config_t &config ) {
+    return has_no_transition( config ) && config.sustain > envelope_generator_t::lowest;
+  }
   nlohmann::json is_valid_eg_config(
     const nlohmann::json &config
   ) {
@@ -100,11 +117,11 @@ namespace smfp {
   }
   void envelope_generator_t::note_on( const channel_state_t &cst, const active_note_t &/*nst*/ ) {
     at = std::chrono::nanoseconds( 0 );
-    attack1 = config.default_attack1 * ( cst.get< channel_variable_id_t::tvf_tva_envelope_attack_time >() + 1.f );
-    attack2 = config.default_attack2 * ( cst.get< channel_variable_id_t::tvf_tva_envelope_attack_time >() + 1.f );
-    decay1 = config.default_decay1 * ( cst.get< channel_variable_id_t::tvf_tva_envelope_decay_time >() + 1.f );
-    decay2 = config.default_decay2 * ( cst.get< channel_variable_id_t::tvf_tva_envelope_decay_time >() + 1.f );
-    release = config.default_release * ( cst.get< channel_variable_id_t::tvf_tva_envelope_release_time >() + 1.f );
+    attack1 = config.default_attack1 * cst.get_attack_time_scale();
+    attack2 = config.default_attack2 * cst.get_attack_time_scale();
+    decay1 = config.default_decay1 * cst.get_decay_time_scale();
+    decay2 = config.default_decay2 * cst.get_decay_time_scale();
+    release = config.default_release * cst.get_release_time_scale();
     init_delay();
   }
   void envelope_generator_t::clear( const channel_state_t & ) {
@@ -121,6 +138,45 @@ namespace smfp {
     auto value = ( this->*state )( step );
     return value;
   }
+  // operator()をcount回呼んだのと同じ状態まで進めて最後の値を返す
+  // 直線で変化する区間は1回の計算で飛ばす
+  float envelope_generator_t::skip( std::chrono::nanoseconds step, uint64_t count ) {
+    if( count == 0u ) return -std::numeric_limits< float >::infinity();
+    const float dt = std::chrono::duration_cast< std::chrono::duration< float > >( step ).count();
+    while( count > 1u ) {
+      const auto remaining = get_remaining_steps( step );
+      if( remaining >= count ) {
+        current_level += float( count - 1u ) * dt * current_tangent;
+        at += step * ( count - 1u );
+        break;
+      }
+      current_level += float( remaining - 1u ) * dt * current_tangent;
+      at += step * ( remaining - 1u );
+      ( this->*state )( step );
+      count -= remaining;
+    }
+    return ( this->*state )( step );
+  }
+  // 次の状態に移るまでのステップ数
+  uint64_t envelope_generator_t::get_remaining_steps( std::chrono::nanoseconds step ) const {
+    constexpr auto never = std::numeric_limits< uint64_t >::max();
+    const double dt = std::chrono::duration_cast< std::chrono::duration< double > >( step ).count();
+    const double elapsed = std::chrono::duration_cast< std::chrono::duration< double > >( at ).count();
+    const auto until = [&]( double length ) {
+      return uint64_t( std::max( std::ceil( ( length - elapsed ) / dt ), 1.0 ) );
+    };
+    if( state == &envelope_generator_t::calc_delay ) return until( config.delay );
+    else if( state == &envelope_generator_t::calc_attack1 ) return until( attack1 );
+    else if( state == &envelope_generator_t::calc_attack2 ) return until( attack2 );
+    else if( state == &envelope_generator_t::calc_hold ) return until( config.hold );
+    else if( state == &envelope_generator_t::calc_decay1 ) return until( decay1 );
+    else if( state == &envelope_generator_t::calc_decay2 ) return until( decay2 );
+    else if( state == &envelope_generator_t::calc_release ) {
+      if( current_tangent >= 0.f ) return never;
+      return uint64_t( std::max( std::ceil( ( current_level - lowest ) / ( -current_tangent * dt ) ), 1.0 ) );
+    }
+    return never;
+  }
   bool envelope_generator_t::is_end() const {
     return state == &envelope_generator_t::calc_end;
   }
@@ -1,9 +1,18 @@
 #include <cmath>
+#include <array>
 #include <smfp/get_frequency.hpp>
 
 namespace smfp {
+  namespace {
+    // ノート番号毎のベンドとチューニングを掛ける前の周波数
+    const std::array< float, 128u > note_frequency = [] {
+      std::array< float, 128u > table;
+      for( unsigned int i = 0u; i != table.size(); ++i )
+        table[ i ] = std::exp2f( ( ( float( i ) + 3.f ) / 12.f ) ) * 6.875f;
+      return table;
+    }();
+  }
   float get_frequency( const channel_state_t &cst, const active_note_t &nst ) {
-    return std::exp2f( ( ( float( nst.channel_note & 0xFF ) + cst.get_pitch_bend() + 3.f ) / 12.f ) ) * 6.875f;
+    return note_frequency[ nst.channel_note & 0x7F ] * cst.get_pitch_ratio();
   }
 }
-
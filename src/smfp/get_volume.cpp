@@ -1,16 +1,23 @@
 #include <cmath>
+#include <array>
 #include <limits>
 #include <smfp/get_volume.hpp>
 
 namespace smfp {
+  namespace {
+    // 40*log10(v/127)の表
+    const std::array< float, 128u > velocity_db = [] {
+      std::array< float, 128u > table;
+      table[ 0 ] = -std::numeric_limits< float >::infinity();
+      for( unsigned int i = 1u; i != table.size(); ++i )
+        table[ i ] = 40 * std::log10( i / 127.f );
+      return table;
+    }();
+  }
   float get_volume( const channel_state_t &cst, const active_note_t &nst ) {
     auto cv = cst.get< channel_variable_id_t::volume >();
     if( cv == -std::numeric_limits< float >::infinity() || nst.velocity == 0u || nst.polyphonic_key_pressure == 0u )
       return -std::numeric_limits< float >::infinity();
-    return
-      cst.get< channel_variable_id_t::volume >() +
-      40 * std::log10( nst.velocity / 127.f ) +
-      40 * std::log10( nst.polyphonic_key_pressure / 127.f );
+    return cv + velocity_db[ nst.velocity & 0x7Fu ] + velocity_db[ nst.polyphonic_key_pressure & 0x7Fu ];
   }
 }
-
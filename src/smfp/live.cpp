@@ -0,0 +1,76 @@
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <smfp/exceptions.hpp>
+#include <smfp/live.hpp>
+
+namespace smfp {
+  namespace {
+    int open_live_input( const std::string &path ) {
+      struct stat buf;
+      if( stat( path.c_str(), &buf ) < 0 ) throw unable_to_open_midi_input( "live_input_t: 入力が存在しない" );
+      if( !S_ISSOCK( buf.st_mode ) ) {
+        const int fd = open( path.c_str(), O_RDONLY );
+        if( fd < 0 ) throw unable_to_open_midi_input( "live_input_t: 入力を開けない" );
+        return fd;
+      }
+      sockaddr_un addr;
+      std::memset( &addr, 0, sizeof( addr ) );
+      addr.sun_family = AF_UNIX;
+      if( path.size() >= sizeof( addr.sun_path ) ) throw unable_to_open_midi_input( "live_input_t: ソケットのパスが長すぎる" );
+      std::copy( path.begin(), path.end(), addr.sun_path );
+      const int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+      if( fd < 0 ) throw unable_to_open_midi_input( "live_input_t: ソケットを作れない" );
+      if( connect( fd, reinterpret_cast< const sockaddr* >( &addr ), sizeof( addr ) ) < 0 ) {
+        close( fd );
+        throw unable_to_open_midi_input( "live_input_t: ソケットに接続できない" );
+      }
+      return fd;
+    }
+  }
+  live_input_t::live_input_t( const std::string &path ) :
+    fd( open_live_input( path ) ), eof( false ), stopping( false ) {
+    reader = std::thread( [this]() { run(); } );
+  }
+  live_input_t::~live_input_t() {
+    stopping = true;
+    reader.join();
+    close( fd );
+  }
+  void live_input_t::take( std::chrono::steady_clock::time_point until, std::vector< live_event_t > &events ) {
+    std::lock_guard< std::mutex > lock( guard );
+    while( !queue.empty() && queue.front().at <= until ) {
+      events.push_back( std::move( queue.front() ) );
+      queue.pop_front();
+    }
+  }
+  void live_input_t::run() {
+    midi_byte_decoder_t decoder;
+    std::array< uint8_t, 256u > buf;
+    while( !stopping ) {
+      // 終了の要求に気づけるようにpollで待つ
+      pollfd p{ fd, POLLIN, 0 };
+      const auto r = poll( &p, 1, 10 );
+      if( r < 0 && errno == EINTR ) continue;
+      if( r < 0 ) break;
+      if( r == 0 ) continue;
+      const auto size = read( fd, buf.data(), buf.size() );
+      if( size < 0 && errno == EINTR ) continue;
+      if( size <= 0 ) break;
+      const auto at = std::chrono::steady_clock::now();
+      std::lock_guard< std::mutex > lock( guard );
+      for( ssize_t i = 0; i != size; ++i ) {
+        decoder( buf[ i ], [&]( uint8_t status, auto begin, auto end ) {
+          queue.push_back( live_event_t{ at, status, std::vector< uint8_t >( begin, end ) } );
+        } );
+      }
+    }
+    eof = true;
+  }
+}
@@ -0,0 +1,106 @@
+#include <numeric>
+#include <smfp/load_profile.hpp>
+
+namespace smfp {
+  void load_voice_t::note_on( const channel_state_t&, const active_note_t& ) {
+    profile->on_note_on( *this );
+  }
+  void load_voice_t::note_off( const channel_state_t& ) {
+    if( is_held() ) end = profile->now + profile->release;
+  }
+  void load_voice_t::clear( const channel_state_t& ) {
+    end = std::min( end, profile->now );
+  }
+  load_profile_t::load_profile_t(
+    size_t polyphony,
+    std::chrono::nanoseconds release_,
+    std::chrono::nanoseconds interval_
+  ) : voices( polyphony, load_voice_t( this ) ), intervals( 1u ), release( release_.count() ), interval( interval_.count() ), now( 0u ), steals( 0u ), release_cuts( 0u ) {}
+  void load_profile_t::advance( uint64_t at ) {
+    while( now < at ) {
+      const uint64_t boundary = intervals.size() * interval;
+      const uint64_t to = std::min( at, boundary );
+      for( const auto &v: voices )
+        intervals.back().voice_time += v.get_overlap( now, to );
+      now = to;
+      if( now == boundary ) {
+        // 区間の最初の瞬間に鳴っているボイスもその区間の最大値の候補になる
+        intervals.emplace_back();
+        intervals.back().peak = get_active_voices();
+      }
+    }
+  }
+  void load_profile_t::on_note_on( load_voice_t &voice ) {
+    if( voice.is_active( now ) ) {
+      if( voice.is_held() ) ++steals;
+      else ++release_cuts;
+    }
+    voice.begin = now;
+    voice.end = std::numeric_limits< uint64_t >::max();
+    intervals.back().peak = std::max( intervals.back().peak, get_active_voices() );
+  }
+  uint32_t load_profile_t::get_active_voices() const {
+    return std::count_if( voices.begin(), voices.end(), [&]( const auto &v ) { return v.is_active( now ); } );
+  }
+  nlohmann::json load_profile_t::to_json( std::chrono::nanoseconds step, double voice_cost, double idle_cost ) const {
+    const double duration = now / 1.e9;
+    const double sample_rate = 1.e9 / step.count();
+    uint32_t peak = 0u;
+    uint64_t voice_time = 0u;
+    double peak_factor = 0.;
+    std::array< uint64_t, 16u > events;
+    std::array< double, 16u > peak_events;
+    events.fill( 0u );
+    peak_events.fill( 0. );
+    auto intervals_ = nlohmann::json::array();
+    for( size_t i = 0u; i != intervals.size(); ++i ) {
+      const auto &iv = intervals[ i ];
+      const uint64_t begin = i * interval;
+      // 最後の区間は曲の終わりで切れている
+      const uint64_t length = std::min( now, begin + interval ) - std::min( now, begin );
+      if( length == 0u ) continue;
+      const double seconds = length / 1.e9;
+      const double active = iv.voice_time / 1.e9;
+      const double cpu = ( active * voice_cost + ( voices.size() * seconds - active ) * idle_cost ) * sample_rate / 1.e9;
+      peak = std::max( peak, iv.peak );
+      voice_time += iv.voice_time;
+      peak_factor = std::max( peak_factor, cpu / seconds );
+      for( size_t c = 0u; c != 16u; ++c ) {
+        events[ c ] += iv.events[ c ];
+        peak_events[ c ] = std::max( peak_events[ c ], iv.events[ c ] / seconds );
+      }
+      intervals_.push_back( nlohmann::json{
+        { "time", begin / 1.e9 },
+        { "peak_voices", iv.peak },
+        { "average_voices", active / seconds },
+        { "events", std::accumulate( iv.events.begin(), iv.events.end(), uint64_t( 0u ) ) },
+        { "realtime_factor", cpu / seconds }
+      } );
+    }
+    auto channels = nlohmann::json::array();
+    for( size_t c = 0u; c != 16u; ++c ) {
+      if( !events[ c ] ) continue;
+      channels.push_back( nlohmann::json{
+        { "channel", c },
+        { "events", events[ c ] },
+        { "events_per_second", duration > 0. ? events[ c ] / duration : 0. },
+        { "peak_events_per_second", peak_events[ c ] }
+      } );
+    }
+    const double active = voice_time / 1.e9;
+    const double cpu = ( active * voice_cost + ( voices.size() * duration - active ) * idle_cost ) * sample_rate / 1.e9;
+    return nlohmann::json{
+      { "duration", duration },
+      { "polyphony", voices.size() },
+      { "peak_voices", peak },
+      { "average_voices", duration > 0. ? active / duration : 0. },
+      { "steals", steals },
+      { "release_cuts", release_cuts },
+      { "channels", channels },
+      { "cpu_seconds", cpu },
+      { "realtime_factor", duration > 0. ? cpu / duration : 0. },
+      { "peak_realtime_factor", peak_factor },
+      { "intervals", intervals_ }
+    };
+  }
+}
@@ -6,6 +6,12 @@ namespace smfp {
     requested_scale( 0 ),
     step( step_ ),
     spms( std::chrono::duration_cast< std::chrono::duration< float > >( step_ ).count() * 1000.f ) {}
+  // 音が無ければ振幅の制限は働かないので、スケールは要求された値に指数的に近付くだけになる
+  void mixer_t::skip( float env_sum, uint64_t count ) {
+    requested_scale = get_scale( 40.f * std::log10( env_sum ) );
+    const float rate = ( current_scale < requested_scale ) ? spms : spms / 100.f;
+    current_scale = requested_scale + ( current_scale - requested_scale ) * std::pow( 1.f - rate, float( count ) );
+  }
   float mixer_t::get_scale( float x ) const {
     if( x < -20.f ) return 0;
     else if( x < 0.f ) return ( 1.f / 40.f ) * x * x + x + 10.f;
@@ -0,0 +1,63 @@
+#include <smfp/sine.hpp>
+#include <smfp/get_volume.hpp>
+
+namespace smfp {
+  sine_t::sine_t( const fmeg_config_t< 0u > &config ) :
+    op( config ) {}
+  sine_t::sine_t( const nlohmann::json &config ) :
+    sine_t( fmeg_config_t< 0u >( config ) ) {}
+  nlohmann::json sine_t::dump() const {
+    return {
+      { "op", op.dump() }
+    };
+  }
+  void sine_t::set_config( const channel_state_t &cst, const fmeg_config_t< 0u > &config ) {
+    op.set_config( cst, config );
+  }
+  void sine_t::note_on( const channel_state_t &cst, const active_note_t &nst ) {
+    if( ( nst.channel_note >> 8 ) == 10 ) return;
+    op.note_on( cst, nst );
+    op.set_volume( cst, get_volume( cst, nst ) );
+  }
+  void sine_t::note_off( const channel_state_t &cst ) {
+    op.note_off( cst );
+  }
+  void sine_t::clear( const channel_state_t &cst ) {
+    op.clear( cst );
+  }
+  void sine_t::set_frequency( const channel_state_t &cst, float freq ) {
+    op.set_frequency( cst, freq );
+  }
+  std::tuple< float, float > sine_t::operator()( std::chrono::nanoseconds step ) {
+    const float top = 0.f;
+    return op( step, &top );
+  }
+  std::tuple< float, float > sine_t::advance( std::chrono::nanoseconds step ) {
+    return op.advance( step );
+  }
+  std::tuple< float, float > sine_t::advance( std::chrono::nanoseconds step, uint64_t count ) {
+    return op.advance( step, count );
+  }
+  std::tuple< float, float > sine_t::trace( std::chrono::nanoseconds step ) {
+    return op.advance( step );
+  }
+  std::tuple< float, float > sine_t::skip( std::chrono::nanoseconds step, uint64_t count ) {
+    return op.skip( step, count );
+  }
+  fm_2op_nofb_partials_t sine_t::get_partials() const {
+    fm_2op_nofb_partials_t partials;
+    partials.gain = op.gain;
+    partials.carrier_phase = op.fm.get_phase();
+    partials.carrier_frequency = op.fm.get_tangent();
+    partials.modulator_phase = 0.f;
+    partials.modulator_frequency = 0.f;
+    partials.index = 0.f;
+    return partials;
+  }
+  void sine_t::set_volume( const channel_state_t &cst, float value ) {
+    op.set_volume( cst, value );
+  }
+  bool sine_t::is_end() const {
+    return op.is_end();
+  }
+}
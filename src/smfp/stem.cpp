@@ -0,0 +1,128 @@
+#include <array>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <filesystem>
+#include <smfp/exceptions.hpp>
+#include <smfp/stem.hpp>
+
+namespace smfp {
+  namespace {
+    constexpr std::array< char, 8u > stem_magic{ 'S', 'M', 'F', 'P', 'S', 'T', 'E', 'M' };
+    // マジック、版、context、begin、sizeの後に値とエンベロープを交互に並べる
+    constexpr size_t stem_header_size = 8u + sizeof( uint64_t ) * 4u;
+    bool read_stem_header( std::ifstream &file, uint64_t &context, uint64_t &begin, uint64_t &size ) {
+      std::array< char, 8u > magic;
+      uint64_t version = 0u;
+      file.read( magic.data(), magic.size() );
+      file.read( reinterpret_cast< char* >( &version ), sizeof( version ) );
+      file.read( reinterpret_cast< char* >( &context ), sizeof( context ) );
+      file.read( reinterpret_cast< char* >( &begin ), sizeof( begin ) );
+      file.read( reinterpret_cast< char* >( &size ), sizeof( size ) );
+      return file && magic == stem_magic && version == stem_version;
+    }
+  }
+  uint64_t fnv1a( const void *data, size_t size, uint64_t hash ) {
+    const auto bytes = reinterpret_cast< const uint8_t* >( data );
+    for( size_t i = 0u; i != size; ++i ) {
+      hash ^= bytes[ i ];
+      hash *= 0x100000001b3ull;
+    }
+    return hash;
+  }
+  uint64_t fnv1a( const std::string &data, uint64_t hash ) {
+    return fnv1a( data.data(), data.size(), hash );
+  }
+  std::string get_stem_filename( const std::string &dir, uint64_t hash ) {
+    std::array< char, 17u > hex;
+    for( size_t i = 0u; i != 16u; ++i )
+      hex[ i ] = "0123456789abcdef"[ ( hash >> ( 60u - i * 4u ) ) & 0xFu ];
+    hex[ 16 ] = '\0';
+    return ( std::filesystem::path( dir ) / ( std::string( hex.data() ) + ".stem" ) ).string();
+  }
+  stem_writer_t::stem_writer_t( const std::string &filename_, uint64_t context ) :
+    filename( filename_ ), temp( filename_ + ".tmp" ), started( false ), begin( 0u ), size( 0u ) {
+    std::filesystem::create_directories( std::filesystem::path( filename ).parent_path() );
+    // 書き込み途中のファイルをキャッシュとして読まないように別名で書いてから置き換える
+    file.open( temp, std::ofstream::binary );
+    file.write( stem_magic.data(), stem_magic.size() );
+    file.write( reinterpret_cast< const char* >( &stem_version ), sizeof( stem_version ) );
+    file.write( reinterpret_cast< const char* >( &context ), sizeof( context ) );
+    // beginとsizeはcloseで書き直す
+    file.write( reinterpret_cast< const char* >( &begin ), sizeof( begin ) );
+    file.write( reinterpret_cast< const char* >( &size ), sizeof( size ) );
+    if( !file ) throw unable_to_write_stem( "stem_writer_t: stemを書き込めない" );
+  }
+  void stem_writer_t::operator()( uint64_t tile_begin, const std::vector< float > &val, const std::vector< float > &env ) {
+    const auto is_active = []( float v ) { return v != 0.f; };
+    size_t head = 0u;
+    if( !started ) {
+      head = std::distance( env.begin(), std::find_if( env.begin(), env.end(), is_active ) );
+      if( head == env.size() ) return;
+      started = true;
+      begin = tile_begin + head;
+    }
+    // 後ろの無音はcloseで切り詰めるので、鳴っているかどうかに関わらずそのまま書く
+    const auto tail = std::find_if( env.rbegin(), env.rend(), is_active );
+    if( tail != env.rend() ) size = tile_begin + std::distance( tail, env.rend() ) - begin;
+    buffer.resize( ( env.size() - head ) * 2u );
+    for( size_t t = head; t != env.size(); ++t ) {
+      buffer[ ( t - head ) * 2u ] = val[ t ];
+      buffer[ ( t - head ) * 2u + 1u ] = env[ t ];
+    }
+    file.write( reinterpret_cast< const char* >( buffer.data() ), buffer.size() * sizeof( float ) );
+    if( !file ) throw unable_to_write_stem( "stem_writer_t: stemを書き込めない" );
+  }
+  void stem_writer_t::close() {
+    file.seekp( stem_magic.size() + sizeof( uint64_t ) * 2u );
+    file.write( reinterpret_cast< const char* >( &begin ), sizeof( begin ) );
+    file.write( reinterpret_cast< const char* >( &size ), sizeof( size ) );
+    file.close();
+    if( !file ) throw unable_to_write_stem( "stem_writer_t: stemを書き込めない" );
+    std::filesystem::resize_file( temp, stem_header_size + size * sizeof( float ) * 2u );
+    std::filesystem::rename( temp, filename );
+  }
+  bool stem_reader_t::open( const std::string &filename ) {
+    file.open( filename, std::ifstream::binary );
+    if( !file ) return false;
+    uint64_t context = 0u;
+    std::error_code ec;
+    // 書き込みが途中で止まったstemは使わない
+    if( !read_stem_header( file, context, begin, size ) || std::filesystem::file_size( filename, ec ) != stem_header_size + size * sizeof( float ) * 2u ) {
+      file.close();
+      return false;
+    }
+    position = 0u;
+    return true;
+  }
+  void stem_reader_t::add( uint64_t tile_begin, size_t length, float *val, float *env ) {
+    const auto from = std::max( tile_begin, begin + position );
+    const auto to = std::min( tile_begin + length, begin + size );
+    if( from >= to ) return;
+    buffer.resize( ( to - from ) * 2u );
+    file.read( reinterpret_cast< char* >( buffer.data() ), buffer.size() * sizeof( float ) );
+    if( !file ) throw unable_to_read_stem( "stem_reader_t: stemが途中で切れている" );
+    for( uint64_t t = from; t != to; ++t ) {
+      val[ t - tile_begin ] += buffer[ ( t - from ) * 2u ];
+      env[ t - tile_begin ] += buffer[ ( t - from ) * 2u + 1u ];
+    }
+    position = to - begin;
+  }
+  void evict_stems( const std::string &dir, uint64_t context, const std::vector< std::string > &used ) {
+    std::error_code ec;
+    for( const auto &entry: std::filesystem::directory_iterator( dir, ec ) ) {
+      if( !entry.is_regular_file( ec ) || entry.path().extension() != ".stem" ) continue;
+      if( std::any_of( used.begin(), used.end(), [&]( const auto &u ) { return std::filesystem::path( u ).filename() == entry.path().filename(); } ) ) continue;
+      bool stale = true;
+      {
+        std::ifstream file( entry.path(), std::ifstream::binary );
+        uint64_t stem_context = 0u;
+        uint64_t begin = 0u;
+        uint64_t size = 0u;
+        // 他の曲のstemは残す
+        if( read_stem_header( file, stem_context, begin, size ) && stem_context != context ) stale = false;
+      }
+      if( stale ) std::filesystem::remove( entry.path(), ec );
+    }
+  }
+}
@@ -1,18 +1,82 @@
+#include <cctype>
+#include <string>
+#include <smfp/exceptions.hpp>
 #include <smfp/wavesink.hpp>
 
 namespace smfp {
-  wavesink::wavesink( const char *filename, uint32_t sample_rate ) {
+  namespace {
+    // 描画中のバッファ、書き込み待ちのバッファ、書き込み中のバッファ
+    constexpr size_t buffer_count = 3u;
+    // これだけ溜まったら書き込みスレッドに渡す
+    constexpr size_t submit_size = 16384u;
+    bool has_extension( const std::string &filename, const char *ext ) {
+      const std::string e( ext );
+      if( filename.size() < e.size() ) return false;
+      return std::equal( e.begin(), e.end(), std::prev( filename.end(), e.size() ), []( char l, char r ) {
+        return l == std::tolower( static_cast< unsigned char >( r ) );
+      } );
+    }
+    // 拡張子が.flacならFLAC、.oggか.ogaならOgg Vorbis、それ以外はWAVで書く
+    int get_sndfile_format( const std::string &filename, sample_format_t format ) {
+      const int subtype =
+        ( format == sample_format_t::pcm24 ) ? SF_FORMAT_PCM_24 :
+        ( format == sample_format_t::float32 ) ? SF_FORMAT_FLOAT :
+        SF_FORMAT_PCM_16;
+      if( has_extension( filename, ".flac" ) ) {
+        if( format == sample_format_t::float32 ) throw unable_to_open_output( "wavesink: FLACには浮動小数点数のサンプルを書き込めない" );
+        return SF_FORMAT_FLAC|subtype;
+      }
+      if( has_extension( filename, ".ogg" ) || has_extension( filename, ".oga" ) ) return SF_FORMAT_OGG|SF_FORMAT_VORBIS;
+      return SF_FORMAT_WAV|subtype;
+    }
+    // 飽和させながら四捨五入する
+    // 分岐を含まないのでベクトル化される
+    template< typename T >
+    T quantize( float value, float scale, float lowest, float highest ) {
+      const float v = std::min( std::max( value * scale, lowest ), highest );
+      return T( v + ( v < 0.f ? -0.5f : 0.5f ) );
+    }
+  }
+  wavesink::wavesink( const char *filename, uint32_t sample_rate, sample_format_t format_, bool dither_ ) :
+    format( format_ ), dither( dither_ ), seed( 0x6a09e667u ), stopping( false ), failed( false ) {
     config.frames = 0;
     config.samplerate = sample_rate;
     config.channels = 1;
-    config.format = SF_FORMAT_WAV|SF_FORMAT_PCM_16;
+    config.format = get_sndfile_format( filename, format );
+    // Vorbisのエンコーダは浮動小数点数を受け取るので量子化しない
+    if( ( config.format & SF_FORMAT_SUBMASK ) == SF_FORMAT_VORBIS ) format = sample_format_t::float32;
     config.sections = 0;
     config.seekable = 1;
     file = sf_open( filename, SFM_WRITE, &config );
+    if( !file ) throw unable_to_open_output( "wavesink: 出力を開けない" );
+    free.resize( buffer_count - 1u );
+    for( auto &b: free ) b.reserve( submit_size );
+    current.reserve( submit_size );
+    writer = std::thread( [this]() { run(); } );
   }
+  // デストラクタからは例外を投げられないので、失敗を知るにはcloseを呼ぶ
   wavesink::~wavesink() {
+    if( file ) finish();
+  }
+  void wavesink::close() {
+    if( !file ) return;
+    finish();
+    if( failed ) throw unable_to_write_output( "wavesink: 出力に書き込めない" );
+  }
+  void wavesink::finish() {
+    {
+      std::unique_lock< std::mutex > lock( guard );
+      if( !current.empty() ) filled.push_back( std::move( current ) );
+      stopping = true;
+    }
+    cond.notify_all();
+    writer.join();
     sf_write_sync( file );
-    sf_close( file );
+    if( sf_close( file ) != 0 ) failed = true;
+    file = nullptr;
+  }
+  void wavesink::flush() {
+    if( !current.empty() ) submit();
   }
   void wavesink::play_if_not_playing() const {
   }
@@ -20,9 +84,80 @@ namespace smfp {
     return true;
   }
   void wavesink::operator()( const float data ) {
-    int16_t ibuf[ 1 ];
-    std::transform( &data, &data + 1, ibuf, []( const float &value ) { return int16_t( value * 32767 ); } );
-    sf_write_short( file, ibuf, 1 );
+    current.push_back( data );
+    submit_if_full();
+  }
+  void wavesink::write( const float *data, size_t size ) {
+    current.insert( current.end(), data, std::next( data, size ) );
+    submit_if_full();
+  }
+  void wavesink::submit_if_full() {
+    if( current.size() >= submit_size ) submit();
+  }
+  void wavesink::submit() {
+    std::unique_lock< std::mutex > lock( guard );
+    // 全てのバッファが書き込み待ちなら1つ空くまで待つ
+    cond.wait( lock, [&]() { return !free.empty() || failed; } );
+    if( failed ) throw unable_to_write_output( "wavesink: 出力に書き込めない" );
+    filled.push_back( std::move( current ) );
+    current = std::move( free.back() );
+    free.pop_back();
+    current.clear();
+    lock.unlock();
+    cond.notify_all();
+  }
+  void wavesink::run() {
+    while( true ) {
+      std::unique_lock< std::mutex > lock( guard );
+      cond.wait( lock, [&]() { return !filled.empty() || stopping; } );
+      if( filled.empty() ) return;
+      auto data = std::move( filled.front() );
+      filled.pop_front();
+      lock.unlock();
+      if( !failed ) write_block( data );
+      lock.lock();
+      free.push_back( std::move( data ) );
+      lock.unlock();
+      cond.notify_all();
+    }
+  }
+  void wavesink::write_block( const std::vector< float > &data ) {
+    sf_count_t written = 0;
+    if( format == sample_format_t::float32 ) {
+      written = sf_write_float( file, data.data(), data.size() );
+    }
+    else {
+      const float *src = data.data();
+      // 量子化の1ステップの幅の三角分布のノイズを足す
+      if( dither ) {
+        const float lsb = ( format == sample_format_t::pcm16 ) ? 1.f / 32767.f : 1.f / 8388607.f;
+        dither_buffer.resize( data.size() );
+        for( size_t i = 0u; i != data.size(); ++i ) {
+          seed = seed * 1664525u + 1013904223u;
+          const float r1 = ( seed >> 8 ) * ( 1.f / 16777216.f );
+          seed = seed * 1664525u + 1013904223u;
+          const float r2 = ( seed >> 8 ) * ( 1.f / 16777216.f );
+          dither_buffer[ i ] = data[ i ] + ( r1 - r2 ) * lsb;
+        }
+        src = dither_buffer.data();
+      }
+      if( format == sample_format_t::pcm16 ) {
+        short_buffer.resize( data.size() );
+        for( size_t i = 0u; i != data.size(); ++i )
+          short_buffer[ i ] = quantize< int16_t >( src[ i ], 32767.f, -32768.f, 32767.f );
+        written = sf_write_short( file, short_buffer.data(), short_buffer.size() );
+      }
+      else {
+        // sf_write_intは32bitの範囲を満たす値を期待するので上位24bitに詰める
+        int_buffer.resize( data.size() );
+        for( size_t i = 0u; i != data.size(); ++i )
+          int_buffer[ i ] = quantize< int >( src[ i ], 8388607.f, -8388608.f, 8388607.f ) * 256;
+        written = sf_write_int( file, int_buffer.data(), int_buffer.size() );
+      }
+    }
+    if( written != sf_count_t( data.size() ) ) {
+      std::unique_lock< std::mutex > lock( guard );
+      failed = true;
+    }
   }
 }
-